@@ -1,9 +1,12 @@
 // Copyright Prog'z. All Rights Reserved.
 
 #include "GenThread.h"
+#include "ThreadAllocationCounter.h"
+#include "LatencyHistogram.h"
 #include "utilities.hpp"
 #include "abstractPipeline.hpp"
 #include "generationHistory.h"
+#include "autoRegressivePipelineObserver.hpp"
 
 FString FGenThread::RelativeToAbsoluteContentPath(const FString& BaseStr)
 {
@@ -18,9 +21,10 @@ FString FGenThread::RelativeToAbsoluteContentPath(const FString& BaseStr)
 	}
 }
 
-void FGenThread::SetPipeline(IAutoRegressivePipeline* NewPipeline)
+void FGenThread::SetPipeline(const FMIDIPipelinePtr& NewPipeline)
 {
-	Pipeline = NewPipeline;
+	PipelineRef = NewPipeline;
+	Pipeline = NewPipeline.Get();
 }
 
 void FGenThread::PreStart(const FString& InTokenizerPath, const FString& InModelPath, const TArray<int32>& InTokens)
@@ -39,6 +43,22 @@ void FGenThread::Start(const FString& InTokenizerPath, const FString& InModelPat
 void FGenThread::Start()
 {
 	ensureMsgf(!HasStarted(), TEXT("FGenThread has already started!"));
+
+	// Sized before the thread starts, so other threads never see the array being resized
+	Mutex.Lock();
+	GenBatches.SetNum(NbBatches);
+	for (FGenBatch& GenBatch : GenBatches)
+	{
+		// Reserved so the token history doesn't grow while generating, unless it gets very long
+		GenBatch.EncodedTokens.Reset(EncodedTokens.Num() + NbReservedTokens);
+		GenBatch.EncodedTokens.Append(EncodedTokens);
+		GenBatch.NextNoteIndexToPublish = 0;
+		// The tokens set before starting are already known by the consumer
+		GenBatch.NextTokenIndexToPublish = GenBatch.EncodedTokens.Num();
+		GenBatch.Checkpoints.Reset(LineNbMaxToken / NbTokensPerCheckpoint + NbReservedCheckpoints);
+	}
+	Mutex.Unlock();
+
 	Thread = FRunnableThread::Create(this, TEXT("GenThread"), 0, TPri_TimeCritical);
 }
 
@@ -73,6 +93,24 @@ FGenThread::~FGenThread()
 		Thread->Kill();
 		delete Thread;
 	}
+
+	// Observers point to the generator, the next user of the pipeline mustn't call them
+	if (Pipeline != nullptr)
+	{
+		for (const TSharedPtr<AutoRegressivePipelineObserver>& Observer : Observers)
+		{
+			Pipeline->removeObserver(Observer.Get());
+		}
+	}
+	Observers.Reset();
+	Pipeline = nullptr;
+	PipelineRef.Reset();
+}
+
+void FGenThread::SetNbBatches(int32 InNbBatches)
+{
+	ensureMsgf(!HasStarted(), TEXT("FGenThread::SetNbBatches must be called before Start()"));
+	NbBatches = FMath::Max(1, InNbBatches);
 }
 
 bool FGenThread::Init()
@@ -107,146 +145,348 @@ bool FGenThread::Init()
 		runInstance_setSearchStrategy(runInstance, [](const struct SearchArgs& args, void* searchStrategyData)
 		{
 			FGenThread* GenThread = (FGenThread*)searchStrategyData;
-			GenThread->Mutex.Lock();
-			FOnSearch OnSearch = GenThread->OnSearch;
-			GenThread->Mutex.Unlock();
-
-			OnSearch.Broadcast(args);
+			GenThread->OnSearch.Get().Broadcast(args);
 		});
 	}
 	else
 	{
-		Batch2 = Pipeline->addBatch();
-		Pipeline->batchSet(Batch2, EncodedTokens.GetData(), EncodedTokens.Num(), 0);
+		for (FGenBatch& GenBatch : GenBatches)
+		{
+			GenBatch.Handle = Pipeline->addBatch();
+			Pipeline->batchSet(GenBatch.Handle, GenBatch.EncodedTokens.GetData(), GenBatch.EncodedTokens.Num(), 0);
+		}
+
 		Pipeline->setSearchStrategyData(this);
 		Pipeline->setSearchStrategy([](const struct SearchArgs& args, void* searchStrategyData)
 			{
 				FGenThread* GenThread = (FGenThread*)searchStrategyData;
-				GenThread->Mutex.Lock();
-				FOnSearch OnSearch = GenThread->OnSearch;
-				GenThread->Mutex.Unlock();
-				OnSearch.Broadcast(args);
+				GenThread->OnSearch.Get().Broadcast(args);
 			});
 
-		Pipeline->createHistory(*Tokenizer->GetTokenizer()->GetTokenizer());
-
 		BeatGeneratorMutex.Lock();
-		beatGenerator = createBeatGenerator();
+		for (FGenBatch& GenBatch : GenBatches)
+		{
+			GenBatch.BeatGenerator = createBeatGenerator();
+		}
 		BeatGeneratorMutex.Unlock();
 	}
 
+	// The histories are created by Run(), the tokenizer may not be set yet
+	return true;
+}
+
+void FGenThread::SetUpHistories()
+{
+	if (Pipeline != nullptr)
+	{
+		// Creates a history for every batch added so far
+		Pipeline->createHistory(*GetTok().GetTokenizer());
 
-	OnInit.Broadcast();
+		// The batches share the seed, they can be forked from each other up to there
+		for (FGenBatch& GenBatch : GenBatches)
+		{
+			GenBatch.Checkpoints.Add(FGenCheckpoint{ generationHistory_getCurrentTick(Pipeline->getHistory(GenBatch.Handle)), GenBatch.NbSeedTokens });
+		}
+	}
 
-	return true;
+	bHasHistories = true;
+
+	// Sets the search strategy up, now that the tokenizer is there
+	OnInit.Get().Broadcast();
+}
+
+bool FGenThread::ComputeGeneratedUntilTick(int32& OutTick) const
+{
+	OutTick = INT_MAX;
+	for (const FGenBatch& GenBatch : GenBatches)
+	{
+		GenerationHistory* History = Pipeline->getHistory(GenBatch.Handle);
+		const Note* outNotes = nullptr;
+		size_t outLength = 0;
+		generationHistory_getNotes(History, &outNotes, &outLength);
+		if (outNotes == nullptr || outLength == 0)
+		{
+			return false;
+		}
+		OutTick = FMath::Min(OutTick, outNotes[outLength - 1].tick);
+	}
+	return !GenBatches.IsEmpty();
+}
+
+void FGenThread::PublishGeneratedUntilTick()
+{
+	int32 GeneratedUntilTick;
+	if (!ComputeGeneratedUntilTick(GeneratedUntilTick))
+	{
+		GeneratedUntilTick = INT_MIN;
+	}
+
+	const uint32 Version = uint32(GeneratedUntilSnapshot.load(std::memory_order_relaxed) >> 32) + 1;
+	GeneratedUntilSnapshot.store((uint64(Version) << 32) | uint32(GeneratedUntilTick), std::memory_order_release);
+}
+
+bool FGenThread::GetGeneratedUntilTick(int32& OutTick) const
+{
+	OutTick = int32(uint32(GeneratedUntilSnapshot.load(std::memory_order_acquire)));
+	return OutTick != INT_MIN;
+}
+
+uint32 FGenThread::GetGeneratedUntilVersion() const
+{
+	return uint32(GeneratedUntilSnapshot.load(std::memory_order_acquire) >> 32);
+}
+
+void FGenThread::GetLastRewind(uint32& OutEpoch, int32& OutTick) const
+{
+	const uint64 Snapshot = RewindSnapshot.load(std::memory_order_acquire);
+	OutEpoch = uint32(Snapshot >> 32);
+	OutTick = int32(uint32(Snapshot));
+}
+
+uint32 FGenThread::GetRewindEpoch() const
+{
+	return uint32(RewindSnapshot.load(std::memory_order_acquire) >> 32);
 }
 
 bool FGenThread::ShouldResumeGeneration() const
 {
-	GenerationHistory* History = Pipeline->getHistory(Batch2);
-	const Note* outNotes;
-	size_t outLength;
-	generationHistory_getNotes(History, &outNotes, &outLength);
-	if (outNotes == nullptr)
+	int32 GeneratedUntilTick;
+	if (!GetGeneratedUntilTick(GeneratedUntilTick))
 	{
 		return true;
 	}
-	return outNotes[outLength - 1].tick < CurrentTick + NbMinTicksAhead;
+	return GeneratedUntilTick < CurrentTick + Scheduler.GetResumeTicksAhead();
 }
 
 bool FGenThread::ShouldSleep() const
 {
-	GenerationHistory* History = Pipeline->getHistory(Batch2);
-	const Note* outNotes = nullptr;
-	size_t outLength;
-	generationHistory_getNotes(History, &outNotes, &outLength);
-	if (outNotes == nullptr)
+	if (bIsFreeRunning.load(std::memory_order_relaxed))
+	{
+		return false;
+	}
+
+	// Batches are generated together, so only sleep once the one that is the least ahead has enough notes
+	int32 GeneratedUntilTick;
+	if (!GetGeneratedUntilTick(GeneratedUntilTick))
 	{
 		return false;
 	}
-	return outNotes[outLength - 1].tick >= CurrentTick + NbMaxTicksAhead;
+	SET_FLOAT_STAT(STAT_GenThread_ActualLookaheadMs, Scheduler.TicksToMs(GeneratedUntilTick - CurrentTick));
+	return GeneratedUntilTick >= CurrentTick + Scheduler.GetSleepTicksAhead();
 }
 
-uint32 FGenThread::Run()
+void FGenThread::SetContext(const FGenBatch& GenBatch, int32 NbMaxTokens)
 {
-	if (!forceReupdate)
+	int32 start = FMath::Max(0, GenBatch.EncodedTokens.Num() - NbMaxTokens);
+	const int32* Context = GenBatch.EncodedTokens.GetData() + start;
+	const int32 ContextSize = GenBatch.EncodedTokens.Num() - start;
+
+	if (Pipeline != nullptr)
 	{
-		TArray<int32> Context;
-		int32 start = FMath::Max(0, EncodedTokens.Num() - LineNbMaxToken);
-		for (int32 i = start; i < EncodedTokens.Num(); i++)
-		{
-			Context.Add(EncodedTokens[i]);
-		}
+		Pipeline->batchSet(GenBatch.Handle, Context, ContextSize, start);
+		bIsPrefillPending = true;
+	}
+	else
+	{
+		batch_set(batch, const_cast<int32*>(Context), ContextSize, start);
+	}
+}
 
-		if (Pipeline != nullptr)
+void FGenThread::RecordCheckpoint(FGenBatch& GenBatch)
+{
+	GenerationHistory* History = Pipeline->getHistory(GenBatch.Handle);
+	const int32 Tick = generationHistory_getCurrentTick(History);
+	const int32 NbTokens = GenBatch.EncodedTokens.Num();
+
+	if (!GenBatch.Checkpoints.IsEmpty())
+	{
+		const FGenCheckpoint& LastCheckpoint = GenBatch.Checkpoints.Last();
+		const bool bHasEnoughTokens = NbTokens - LastCheckpoint.NbTokens >= NbTokensPerCheckpoint;
+		const bool bIsNewPeriod = Tick / NbTicksPerCheckpoint > LastCheckpoint.Tick / NbTicksPerCheckpoint;
+		if (!bHasEnoughTokens && !bIsNewPeriod)
 		{
-			Pipeline->batchSet(Batch2, Context.GetData(), Context.Num(), start);
-			Pipeline->setMaxInputLength(LineNbMaxToken);
+			return;
 		}
-		else
+	}
+
+	GenBatch.Checkpoints.Add(FGenCheckpoint{ Tick, NbTokens });
+
+	// Checkpoints out of the context window can't be restored anymore
+	const int32 WindowStart = NbTokens - LineNbMaxToken;
+	int32 NbOutdatedCheckpoints = 0;
+	while (NbOutdatedCheckpoints < GenBatch.Checkpoints.Num() - 1 && GenBatch.Checkpoints[NbOutdatedCheckpoints].NbTokens < WindowStart)
+	{
+		NbOutdatedCheckpoints++;
+	}
+	GenBatch.Checkpoints.RemoveAt(0, NbOutdatedCheckpoints, EAllowShrinking::No);
+}
+
+bool FGenThread::ForkBatch(int32 BatchIndex, int32 SourceBatchIndex, int32 MaxTick, int32& OutRewindTick)
+{
+	FGenBatch& GenBatch = GenBatches[BatchIndex];
+	const FGenBatch& Source = GenBatches[SourceBatchIndex];
+
+	int32 ForkCheckpointIndex = Source.Checkpoints.Num() - 1;
+	while (ForkCheckpointIndex >= 0 && Source.Checkpoints[ForkCheckpointIndex].Tick > MaxTick)
+	{
+		ForkCheckpointIndex--;
+	}
+	if (ForkCheckpointIndex < 0)
+	{
+		return false;
+	}
+	const FGenCheckpoint ForkCheckpoint = Source.Checkpoints[ForkCheckpointIndex];
+
+	// Both lines are the same since the last fork, the batch only needs the tokens after that
+	const int32 NbMaxSharedTokens = FMath::Min(GenBatch.EncodedTokens.Num(), ForkCheckpoint.NbTokens);
+	int32 NbSharedTokens = 0;
+	while (NbSharedTokens < NbMaxSharedTokens && GenBatch.EncodedTokens[NbSharedTokens] == Source.EncodedTokens[NbSharedTokens])
+	{
+		NbSharedTokens++;
+	}
+	if (NbSharedTokens == ForkCheckpoint.NbTokens)
+	{
+		return false;
+	}
+
+	int32 SharedCheckpointIndex = ForkCheckpointIndex;
+	while (SharedCheckpointIndex >= 0 && Source.Checkpoints[SharedCheckpointIndex].NbTokens > NbSharedTokens)
+	{
+		SharedCheckpointIndex--;
+	}
+	if (SharedCheckpointIndex < 0 || ForkCheckpoint.NbTokens - Source.Checkpoints[SharedCheckpointIndex].NbTokens > LineNbMaxToken)
+	{
+		return false;
+	}
+
+	// The ticks of the shared tokens are the same in both histories
+	OutRewindTick = Source.Checkpoints[SharedCheckpointIndex].Tick;
+	Pipeline->batchRewind(GenBatch.Handle, OutRewindTick);
+
+	GenerationHistory* History = Pipeline->getHistory(GenBatch.Handle);
+	const Note* OutNotes = nullptr;
+	size_t OutLength = 0;
+	generationHistory_getNotes(History, &OutNotes, &OutLength);
+	GenBatch.NextNoteIndexToPublish = FMath::Min(GenBatch.NextNoteIndexToPublish, int32(OutLength));
+
+	const int32* EncodedHistoryTokens = nullptr;
+	int32 NbEncodedHistoryTokens = 0;
+	tokenHistory_getTokens(getEncodedTokensHistory(History), &EncodedHistoryTokens, &NbEncodedHistoryTokens);
+	const int32 NbKeptTokens = FMath::Min(NbSharedTokens, GenBatch.NbSeedTokens + NbEncodedHistoryTokens);
+
+	Mutex.Lock();
+	GenBatch.EncodedTokens.SetNum(NbKeptTokens, EAllowShrinking::No);
+	GenBatch.EncodedTokens.Append(Source.EncodedTokens.GetData() + NbKeptTokens, ForkCheckpoint.NbTokens - NbKeptTokens);
+	Mutex.Unlock();
+	GenBatch.NextTokenIndexToPublish = FMath::Min(GenBatch.NextTokenIndexToPublish, NbKeptTokens);
+
+	// batchSet only feeds the context, the history gets the tokens separately
+	const int32 NbReplayedTokens = ForkCheckpoint.NbTokens - NbKeptTokens;
+	if (NbReplayedTokens > 0)
+	{
+		Pipeline->batchSet(GenBatch.Handle, GenBatch.EncodedTokens.GetData() + NbKeptTokens, NbReplayedTokens, NbKeptTokens);
+		bIsPrefillPending = true;
+		for (int32 i = NbKeptTokens; i < ForkCheckpoint.NbTokens; i++)
 		{
-			batch_set(batch, Context.GetData(), Context.Num(), start);
-			runInstance_setMaxInputLength(runInstance, LineNbMaxToken);
+			addEncodedToken(History, GenBatch.EncodedTokens[i]);
 		}
 	}
+	INC_DWORD_STAT_BY(STAT_GenThread_NbReplayedTokens, NbReplayedTokens);
+
+	GenBatch.Checkpoints.Reset();
+	GenBatch.Checkpoints.Append(Source.Checkpoints.GetData(), ForkCheckpointIndex + 1);
+
+	BeatGeneratorMutex.Lock();
+	beatGenerator_rewind(GenBatch.BeatGenerator, OutRewindTick);
+	BeatGeneratorMutex.Unlock();
+
+	return true;
+}
+
+void FGenThread::RebaseContext(int32 NbContextTokens)
+{
+	// The tokens move to other positions, nothing in the cache can be kept
+	Pipeline->reset();
+
+	for (FGenBatch& GenBatch : GenBatches)
+	{
+		SetContext(GenBatch, NbContextTokens);
+
+		// The cache doesn't have the tokens before the new context anymore
+		const int32 ContextStart = GenBatch.EncodedTokens.Num() - NbContextTokens;
+		GenBatch.Checkpoints.RemoveAll([ContextStart](const FGenCheckpoint& Checkpoint) { return Checkpoint.NbTokens < ContextStart; });
+	}
+	NbTokensSinceLastRefresh = FMath::Min(GenBatches[0].EncodedTokens.Num(), NbContextTokens);
+	bIsContextShortened = NbContextTokens < NbContextTokensAfterRebase;
+
+	INC_DWORD_STAT(STAT_GenThread_NbContextRebases);
+}
+
+uint32 FGenThread::Run()
+{
+	for (FGenBatch& GenBatch : GenBatches)
+	{
+		SetContext(GenBatch, LineNbMaxToken);
+		GenBatch.NbSeedTokens = GenBatch.EncodedTokens.Num();
+	}
+
+	if (Pipeline != nullptr)
+	{
+		Pipeline->setMaxInputLength(LineNbMaxToken);
+	}
+	else
+	{
+		runInstance_setMaxInputLength(runInstance, LineNbMaxToken);
+	}
 
-	NbTokensSinceLastRefresh = EncodedTokens.Num();
+	NbTokensSinceLastRefresh = FMath::Min(GenBatches[0].EncodedTokens.Num(), LineNbMaxToken);
 
 	while (!bShutdown)
 	{
 		SCOPE_CYCLE_COUNTER(STAT_GenThread);
 
-		GenerationHistory* History = Pipeline->getHistory(Batch2);
-		generationHistory_convertToNotes(History);
+		// Woken up by SetSearchStrategy(), SetTok() or Stop()
+		if (!bHasHistories && IsTokenizerLoaded())
+		{
+			SetUpHistories();
+		}
 
-		if (!ShouldIgnoreNextToken.load(std::memory_order_acquire) && ShouldSleep())
+		if (!IsReadyToGenerate())
 		{
-			const Note* outNotes = nullptr;
-			size_t outLength;
-			generationHistory_getNotes(History, &outNotes, &outLength);
-			UE_LOG(LogTemp, Warning, TEXT("=== Pausing GenThread : Current: %d / Generated until: %d"), CurrentTick.load(), outNotes[outLength - 1].tick);
+			SetState(EGenThreadState::WaitingForSetup);
 			Semaphore->Wait();
-			generationHistory_getNotes(History, &outNotes, &outLength);
-			UE_LOG(LogTemp, Warning, TEXT("=== Resuming GenThread : Current: %d / Generated until: %d"), CurrentTick.load(), outNotes[outLength - 1].tick);
+			continue;
 		}
 
-		if (forceReupdate)
 		{
-			if (Pipeline != nullptr)
+			FScopedLatency ScopedLatency(ELatencyStage::NoteConversion);
+			for (int32 BatchIndex = 0; BatchIndex < GenBatches.Num(); BatchIndex++)
 			{
-				Pipeline->reset();
-			}
-			else
-			{
-				runInstance_reset(runInstance);
+				GenerationHistory* History = Pipeline->getHistory(GenBatches[BatchIndex].Handle);
+				generationHistory_convertToNotes(History);
+				PublishNewNotes(BatchIndex);
+				// Tokens that didn't fit in the ring the last time
+				PublishNewTokens(BatchIndex);
 			}
+		}
+		PublishGeneratedUntilTick();
 
+		if (!ShouldIgnoreNextToken.load(std::memory_order_acquire) && ShouldSleep())
+		{
+			// Recomputing the context takes much longer than a token, do it now that there are enough notes ahead
+			if (Pipeline != nullptr && (bIsContextShortened || NbTokensSinceLastRefresh >= LineNbMaxToken - NbRebaseMarginTokens))
 			{
-				TArray<int32> Context;
-				int32 start = FMath::Max(0, EncodedTokens.Num() - LineNbMaxToken);
-				for (int32 i = start; i < EncodedTokens.Num(); i++)
-				{
-					Context.Add(EncodedTokens[i]);
-				}
-
-				if (Pipeline != nullptr)
-				{
-					Pipeline->batchSet(Batch2, Context.GetData(), Context.Num(), start);
-				}
-				else
-				{
-					batch_set(batch, Context.GetData(), Context.Num(), start);
-				}
+				RebaseContext(NbContextTokensAfterRebase);
 			}
-		}
 
-		Mutex.Lock();
-		if (!OnSearch.IsBound())
-		{
-			Mutex.Unlock();
-			continue;
+			int32 GeneratedUntilTick = 0;
+			GetGeneratedUntilTick(GeneratedUntilTick);
+			UE_LOG(LogTemp, Verbose, TEXT("=== Pausing GenThread : Current: %d / Generated until: %d"), CurrentTick.load(), GeneratedUntilTick);
+			SetState(EGenThreadState::Paused);
+			Semaphore->Wait();
+			GetGeneratedUntilTick(GeneratedUntilTick);
+			UE_LOG(LogTemp, Verbose, TEXT("=== Resuming GenThread : Current: %d / Generated until: %d"), CurrentTick.load(), GeneratedUntilTick);
 		}
-		Mutex.Unlock();
 
 		if (ShouldRemoveTokens.load(std::memory_order_acquire))
 		{
@@ -255,17 +495,40 @@ uint32 FGenThread::Run()
 			RemoveCacheAfterTickInternal();
 		}
 
+		if (OnBeforeToken)
+		{
+			OnBeforeToken();
+		}
+
+		// Ahead or not, the window must not overflow
+		// The token waits for the whole context to be computed, so only a short one is fed, the full one is fed once ahead
+		if (Pipeline != nullptr && NbTokensSinceLastRefresh >= LineNbMaxToken - NbForcedRebaseMarginTokens)
+		{
+			RebaseContext(NbContextTokensAfterForcedRebase);
+		}
+
+		SetState(EGenThreadState::Generating);
+
+		const uint64 TokenStartCycles = FPlatformTime::Cycles64();
+		const uint32 NbAllocationsBeforeToken = FThreadAllocationCounter::GetNbAllocations();
+
 		if (Pipeline != nullptr)
 		{
 			CppResult Result;
-			Pipeline->preGenerate(Result);
+			{
+				FScopedLatency ScopedLatency(ELatencyStage::PreGenerate);
+				Pipeline->preGenerate(Result);
+			}
 			if (!Result.IsSuccess())
 			{
 				UE_LOG(LogTemp, Error, TEXT("An error occurred in function %s!\n%hs"), *FString(__FUNCTION__), Result.GetError());
 				return -1;
 			}
 
-			Pipeline->generate(Result);
+			{
+				FScopedLatency ScopedLatency(ELatencyStage::Generate);
+				Pipeline->generate(Result);
+			}
 			if (!Result.IsSuccess())
 			{
 				UE_LOG(LogTemp, Error, TEXT("An error occurred in function %s!\n%hs"), *FString(__FUNCTION__), Result.GetError());
@@ -277,7 +540,10 @@ uint32 FGenThread::Run()
 				continue;
 			}
 
-			Pipeline->postGenerate(Result);
+			{
+				FScopedLatency ScopedLatency(ELatencyStage::PostGenerate);
+				Pipeline->postGenerate(Result);
+			}
 			if (!Result.IsSuccess())
 			{
 				UE_LOG(LogTemp, Error, TEXT("An error occurred in function %s!\n%hs"), *FString(__FUNCTION__), Result.GetError());
@@ -319,28 +585,83 @@ uint32 FGenThread::Run()
 			continue;
 		}
 
-		int32 newToken;
-		if (Pipeline != nullptr)
 		{
-			newToken = Pipeline->batchGetLastGeneratedToken(Batch2);
+			const double TokenMs = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - TokenStartCycles);
+			SET_FLOAT_STAT(STAT_GenThread_TokenMs, TokenMs);
+
+			// The token following a prefill also computed the context, it has its own stat
+			double& WindowWorstMs = bIsPrefillPending ? WindowWorstPrefillTokenMs : WindowWorstTokenMs;
+			WindowWorstMs = FMath::Max(WindowWorstMs, TokenMs);
+			bIsPrefillPending = false;
+			if (++NbTokensInWorstTokenWindow >= NbTokensPerWorstTokenWindow)
+			{
+				SET_FLOAT_STAT(STAT_GenThread_WorstTokenMs, WindowWorstTokenMs);
+				SET_FLOAT_STAT(STAT_GenThread_WorstPrefillTokenMs, WindowWorstPrefillTokenMs);
+				WindowWorstTokenMs = 0.0;
+				WindowWorstPrefillTokenMs = 0.0;
+				NbTokensInWorstTokenWindow = 0;
+			}
+			FLatencyHistograms::Get().Record(ELatencyStage::Token, TokenMs * 1000.0);
+
+			if (Pipeline != nullptr)
+			{
+				Scheduler.RecordToken(TokenMs, generationHistory_getCurrentTick(Pipeline->getHistory(GenBatches[0].Handle)));
+			}
 		}
-		else
+
+		// Every batch got one new token from the same forward pass
+		for (int32 BatchIndex = 0; BatchIndex < GenBatches.Num(); BatchIndex++)
 		{
-			newToken = batch_getLastGeneratedToken(batch);
+			FGenBatch& GenBatch = GenBatches[BatchIndex];
+
+			int32 newToken;
+			if (Pipeline != nullptr)
+			{
+				newToken = Pipeline->batchGetLastGeneratedToken(GenBatch.Handle);
+			}
+			else
+			{
+				newToken = batch_getLastGeneratedToken(batch);
+			}
+
+			Mutex.Lock();
+			GenBatch.EncodedTokens.Add(newToken);
+			Mutex.Unlock();
+
+			if (Pipeline != nullptr)
+			{
+				RecordCheckpoint(GenBatch);
+			}
+
+			PublishNewTokens(BatchIndex);
+
+			if (!bShutdown)
+			{
+				if (ShouldIgnoreNextToken.load(std::memory_order_acquire))
+				{
+					break;
+				}
+
+				OnGenerated.Get().Broadcast(BatchIndex, newToken);
+			}
 		}
-		EncodedTokens.Add(newToken);
 		NbTokensSinceLastRefresh++;
 
-		if (!bShutdown)
+		// Once warmed up, generating a token shouldn't allocate
+		NbGeneratedTokens++;
+		if (FThreadAllocationCounter::IsEnabled())
 		{
-			if (ShouldIgnoreNextToken.load(std::memory_order_acquire))
+			const uint32 NbTokenAllocations = FThreadAllocationCounter::GetNbAllocations() - NbAllocationsBeforeToken;
+			SET_DWORD_STAT(STAT_GenThread_NbTokenAllocations, NbTokenAllocations);
+			if (NbGeneratedTokens > NbWarmUpTokens)
 			{
-				continue;
+				INC_DWORD_STAT_BY(STAT_GenThread_NbSteadyStateAllocations, NbTokenAllocations);
 			}
+		}
 
-			Mutex.Lock();
-			OnGenerated.Broadcast(newToken);
-			Mutex.Unlock();
+		if (NbGeneratedTokens % NbTokensPerLatencyStats == 0)
+		{
+			FLatencyHistograms::Get().PublishStats();
 		}
 	}
 
@@ -349,12 +670,16 @@ uint32 FGenThread::Run()
 
 void FGenThread::Exit() 
 {
-	if (beatGenerator)
+	BeatGeneratorMutex.Lock();
+	for (FGenBatch& GenBatch : GenBatches)
 	{
-		BeatGeneratorMutex.Lock();
-		destroyBeatGenerator(beatGenerator);
-		BeatGeneratorMutex.Unlock();
+		if (GenBatch.BeatGenerator)
+		{
+			destroyBeatGenerator(GenBatch.BeatGenerator);
+			GenBatch.BeatGenerator = nullptr;
+		}
 	}
+	BeatGeneratorMutex.Unlock();
 
 	if (Pipeline == nullptr)
 	{
@@ -377,43 +702,186 @@ void FGenThread::Exit()
 
 void FGenThread::Stop()
 {
+	// Set before waking the thread up, so it doesn't wait again
+	bShutdown = true;
 	if (Semaphore)
 	{
 		Semaphore->Trigger();
 	}
-	bShutdown = true;
+}
+
+void FGenThread::SetTok(const FTokenizerProxyPtr& InTokenizer)
+{
+	if (!InTokenizer.IsValid() || !InTokenizer->GetTokenizer().IsValid())
+	{
+		return;
+	}
+
+	TokenizerMutex.Lock();
+	TokenizerRefs.Add(InTokenizer->GetTokenizer());
+	Tokenizer.store(TokenizerRefs.Last().Get(), std::memory_order_release);
+	TokenizerMutex.Unlock();
+
+	if (Semaphore)
+	{
+		Semaphore->Trigger();
+	}
+}
+
+const FTokenizer& FGenThread::GetTok() const
+{
+	static const FTokenizer EmptyTokenizer;
+	const FTokenizer* CurrentTokenizer = Tokenizer.load(std::memory_order_acquire);
+	return CurrentTokenizer != nullptr ? *CurrentTokenizer : EmptyTokenizer;
+}
+
+bool FGenThread::IsTokenizerLoaded() const
+{
+	return GetTok().GetTokenizer() != nullptr;
+}
+
+bool FGenThread::IsReadyToGenerate() const
+{
+	return bHasHistories && OnSearch.Get().IsBound();
+}
+
+void FGenThread::SetState(EGenThreadState NewState)
+{
+	if (State.exchange(NewState, std::memory_order_relaxed) != NewState)
+	{
+		SET_DWORD_STAT(STAT_GenThread_State, uint32(NewState));
+	}
+}
+
+void FGenThread::PublishNewNotes(int32 BatchIndex)
+{
+	// Read the epoch before checking for a pending rewind,
+	// so notes racing with RemoveCacheAfterTick() are tagged with the old epoch and discarded by the consumer
+	const uint32 Epoch = GetRewindEpoch();
+	if (ShouldIgnoreNextToken.load(std::memory_order_acquire))
+	{
+		return;
+	}
+
+	FGenBatch& GenBatch = GenBatches[BatchIndex];
+	GenerationHistory* History = Pipeline->getHistory(GenBatch.Handle);
+	const Note* OutNotes = nullptr;
+	size_t OutLength = 0;
+	generationHistory_getNotes(History, &OutNotes, &OutLength);
+	if (OutNotes == nullptr)
+	{
+		return;
+	}
+
+	if (NoteDecoder)
+	{
+		// Called even without new notes, the decoder may have events left from the last time
+		const int32 NbNewNotes = int32(OutLength) - GenBatch.NextNoteIndexToPublish;
+		GenBatch.NextNoteIndexToPublish += NoteDecoder(BatchIndex, OutNotes + GenBatch.NextNoteIndexToPublish, NbNewNotes, Epoch);
+		return;
+	}
+
+	while (GenBatch.NextNoteIndexToPublish < int32(OutLength))
+	{
+		// When full, keep the note for the next iteration instead of dropping it
+		if (!GeneratedNotes.Push(FGeneratedNote{ OutNotes[GenBatch.NextNoteIndexToPublish], BatchIndex, Epoch }))
+		{
+			SET_DWORD_STAT(STAT_GenThread_NoteRingOverruns, GeneratedNotes.GetNbOverruns());
+			break;
+		}
+		GenBatch.NextNoteIndexToPublish++;
+	}
+}
+
+void FGenThread::PublishNewTokens(int32 BatchIndex)
+{
+	FGenBatch& GenBatch = GenBatches[BatchIndex];
+	while (GenBatch.NextTokenIndexToPublish < GenBatch.EncodedTokens.Num())
+	{
+		// When full, keep the token for the next one, so the consumer gets every token in order
+		if (!GeneratedTokens.Push(FGeneratedToken{ BatchIndex, GenBatch.EncodedTokens[GenBatch.NextTokenIndexToPublish] }))
+		{
+			const uint32 NbOverruns = GeneratedTokens.GetNbOverruns();
+			SET_DWORD_STAT(STAT_GenThread_TokenRingOverruns, NbOverruns);
+			UE_CLOG(FMath::IsPowerOfTwo(NbOverruns), LogTemp, Warning, TEXT("The generated tokens aren't consumed fast enough, %d tokens are waiting (%u overruns)"),
+				GenBatch.EncodedTokens.Num() - GenBatch.NextTokenIndexToPublish, NbOverruns);
+			break;
+		}
+		GenBatch.NextTokenIndexToPublish++;
+	}
 }
 
 void FGenThread::RemoveCacheAfterTickInternal()
 {
-	int32 CacheTickToRemoveValue = CacheTickToRemove;
-	Pipeline->batchRewind(Batch2, CacheTickToRemoveValue);
-	BeatGeneratorMutex.Lock();
-	beatGenerator_rewind(beatGenerator, CacheTickToRemoveValue);
-	BeatGeneratorMutex.Unlock();
+	// Only the last requested rewind is applied, the tick is read with its epoch
+	uint32 Epoch;
+	int32 CacheTickToRemoveValue;
+	GetLastRewind(Epoch, CacheTickToRemoveValue);
+	for (FGenBatch& GenBatch : GenBatches)
+	{
+		Pipeline->batchRewind(GenBatch.Handle, CacheTickToRemoveValue);
+
+		GenerationHistory* History = Pipeline->getHistory(GenBatch.Handle);
+		const Note* OutNotes = nullptr;
+		size_t OutLength = 0;
+		generationHistory_getNotes(History, &OutNotes, &OutLength);
+		GenBatch.NextNoteIndexToPublish = FMath::Min(GenBatch.NextNoteIndexToPublish, int32(OutLength));
+
+		// Keeps the tokens in sync with the rewound history, so a context refresh doesn't feed removed tokens
+		const int32* EncodedHistoryTokens = nullptr;
+		int32 NbEncodedHistoryTokens = 0;
+		tokenHistory_getTokens(getEncodedTokensHistory(History), &EncodedHistoryTokens, &NbEncodedHistoryTokens);
+		const int32 NbTokens = FMath::Min(GenBatch.EncodedTokens.Num(), GenBatch.NbSeedTokens + NbEncodedHistoryTokens);
+
+		if (&GenBatch == &GenBatches[0])
+		{
+			NbTokensSinceLastRefresh = FMath::Max(0, NbTokensSinceLastRefresh - (GenBatch.EncodedTokens.Num() - NbTokens));
+		}
+
+		Mutex.Lock();
+		GenBatch.EncodedTokens.SetNum(NbTokens, EAllowShrinking::No);
+		Mutex.Unlock();
+		GenBatch.NextTokenIndexToPublish = FMath::Min(GenBatch.NextTokenIndexToPublish, NbTokens);
+
+		GenBatch.Checkpoints.RemoveAll([CacheTickToRemoveValue, NbTokens](const FGenCheckpoint& Checkpoint)
+			{
+				return Checkpoint.Tick > CacheTickToRemoveValue || Checkpoint.NbTokens > NbTokens;
+			});
+
+		BeatGeneratorMutex.Lock();
+		beatGenerator_rewind(GenBatch.BeatGenerator, CacheTickToRemoveValue);
+		BeatGeneratorMutex.Unlock();
+	}
+
+	PublishGeneratedUntilTick();
 	OnCacheRemoved.Broadcast(CacheTickToRemoveValue);
 }
 
-void FGenThread::RemoveCacheAfterTick(int32 GenLibTick, float Ms)
+void FGenThread::RemoveCacheAfterTick(int32 GenLibTick)
 {
-	GenerationHistory* History = Pipeline->getHistory(Batch2);
-	const Note* outNotes = nullptr;
-	size_t outLength;
-	generationHistory_getNotes(History, &outNotes, &outLength);
-	if (outNotes == nullptr)
+	int32 GeneratedUntilTick;
+	if (!GetGeneratedUntilTick(GeneratedUntilTick))
 	{
 		return;
 	}
 
-	if (CacheTickToRemove > outNotes[outLength - 1].tick)
+	// Nothing was generated after that tick
+	if (GenLibTick > GeneratedUntilTick)
 	{
 		return;
 	}
 	
-	ShouldIgnoreNextToken.store(true, std::memory_order_release);
+	ShouldIgnoreNextToken.store(true);
 
-	CacheTickToRemove = GenLibTick;
-	CacheMsToRemove = Ms;
+	// Can be called from the game and the audio threads, the tick is only published with the epoch
+	uint64 Snapshot = RewindSnapshot.load(std::memory_order_relaxed);
+	uint64 NewSnapshot;
+	do
+	{
+		const uint32 Epoch = uint32(Snapshot >> 32) + 1;
+		NewSnapshot = (uint64(Epoch) << 32) | uint32(GenLibTick);
+	}
+	while (!RewindSnapshot.compare_exchange_weak(Snapshot, NewSnapshot, std::memory_order_acq_rel, std::memory_order_relaxed));
 
 	ShouldRemoveTokens.store(true, std::memory_order_release);
 	Semaphore->Trigger();
@@ -421,21 +889,34 @@ void FGenThread::RemoveCacheAfterTick(int32 GenLibTick, float Ms)
 
 void FGenThread::SetSearchStrategy(TFunction<void(const struct SearchArgs& args)> InOnSearch)
 {
-	Mutex.Lock();
 	OnSearch.AddLambda([OnSearchParam = MoveTemp(InOnSearch)](const struct SearchArgs& args) { OnSearchParam(args); });
-	Mutex.Unlock();
+	Semaphore->Trigger();
 }
 
-void FGenThread::SetOnGenerated(TFunction<void(int32 NewToken)> InOnGenerated)
+void FGenThread::SetOnGenerated(TFunction<void(int32 BatchIndex, int32 NewToken)> InOnGenerated)
 {
-	Mutex.Lock();
-	OnGenerated.AddLambda([OnGeneratedParam = MoveTemp(InOnGenerated)](int32 newToken) { OnGeneratedParam(newToken); });
-	Mutex.Unlock();
+	OnGenerated.AddLambda([OnGeneratedParam = MoveTemp(InOnGenerated)](int32 batchIndex, int32 newToken) { OnGeneratedParam(batchIndex, newToken); });
+}
+
+void FGenThread::SetNoteDecoder(TFunction<int32(int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch)> InNoteDecoder)
+{
+	ensureMsgf(!HasStarted(), TEXT("The note decoder must be set before starting the thread"));
+	NoteDecoder = MoveTemp(InNoteDecoder);
+}
+
+void FGenThread::SetOnBeforeToken(TFunction<void()> InOnBeforeToken)
+{
+	ensureMsgf(!HasStarted(), TEXT("The callback must be set before starting the thread"));
+	OnBeforeToken = MoveTemp(InOnBeforeToken);
+}
+
+void FGenThread::AddObserver(const TSharedPtr<AutoRegressivePipelineObserver>& Observer)
+{
+	Pipeline->addObserver(Observer.Get());
+	Observers.Add(Observer);
 }
 
 void FGenThread::AddOnInit(TFunction<void()> InOnInit)
 {
-	Mutex.Lock();
 	OnInit.AddLambda([InOnInitParam = MoveTemp(InOnInit)]() { InOnInitParam(); });
-	Mutex.Unlock();
 }
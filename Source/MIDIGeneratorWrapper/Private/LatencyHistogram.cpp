@@ -0,0 +1,214 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "LatencyHistogram.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+#define DECLARE_LATENCY_STATS(Stage) \
+	DECLARE_FLOAT_COUNTER_STAT(TEXT(#Stage) TEXT(" p50 (ms)"), STAT_MIDIGenLatency_##Stage##_P50, STATGROUP_MIDIGenLatency); \
+	DECLARE_FLOAT_COUNTER_STAT(TEXT(#Stage) TEXT(" p95 (ms)"), STAT_MIDIGenLatency_##Stage##_P95, STATGROUP_MIDIGenLatency); \
+	DECLARE_FLOAT_COUNTER_STAT(TEXT(#Stage) TEXT(" p99 (ms)"), STAT_MIDIGenLatency_##Stage##_P99, STATGROUP_MIDIGenLatency); \
+	DECLARE_FLOAT_COUNTER_STAT(TEXT(#Stage) TEXT(" max (ms)"), STAT_MIDIGenLatency_##Stage##_Max, STATGROUP_MIDIGenLatency);
+
+#define SET_LATENCY_STATS(Stage) \
+	{ \
+		const FLatencyHistogram& Histogram = GetHistogram(ELatencyStage::Stage); \
+		SET_FLOAT_STAT(STAT_MIDIGenLatency_##Stage##_P50, Histogram.GetPercentileUs(0.50) / 1000.0); \
+		SET_FLOAT_STAT(STAT_MIDIGenLatency_##Stage##_P95, Histogram.GetPercentileUs(0.95) / 1000.0); \
+		SET_FLOAT_STAT(STAT_MIDIGenLatency_##Stage##_P99, Histogram.GetPercentileUs(0.99) / 1000.0); \
+		SET_FLOAT_STAT(STAT_MIDIGenLatency_##Stage##_Max, Histogram.GetMaxUs() / 1000.0); \
+	}
+
+DECLARE_LATENCY_STATS(Token)
+DECLARE_LATENCY_STATS(PreGenerate)
+DECLARE_LATENCY_STATS(Generate)
+DECLARE_LATENCY_STATS(PostGenerate)
+DECLARE_LATENCY_STATS(SearchStrategy)
+DECLARE_LATENCY_STATS(NoteConversion)
+DECLARE_LATENCY_STATS(BeatGeneration)
+DECLARE_LATENCY_STATS(Execute)
+
+void FLatencyHistogram::Record(double Us)
+{
+	Buckets[GetBucketIndex(Us)].fetch_add(1, std::memory_order_relaxed);
+
+	double CurrentMaxUs = MaxUs.load(std::memory_order_relaxed);
+	while (Us > CurrentMaxUs && !MaxUs.compare_exchange_weak(CurrentMaxUs, Us, std::memory_order_relaxed))
+	{
+	}
+}
+
+void FLatencyHistogram::Reset()
+{
+	for (std::atomic<uint64>& Bucket : Buckets)
+	{
+		Bucket.store(0, std::memory_order_relaxed);
+	}
+	MaxUs.store(0.0, std::memory_order_relaxed);
+}
+
+uint64 FLatencyHistogram::GetCount() const
+{
+	uint64 Count = 0;
+	for (const std::atomic<uint64>& Bucket : Buckets)
+	{
+		Count += Bucket.load(std::memory_order_relaxed);
+	}
+	return Count;
+}
+
+double FLatencyHistogram::GetPercentileUs(double Percentile) const
+{
+	const uint64 Count = GetCount();
+	if (Count == 0)
+	{
+		return 0.0;
+	}
+
+	const uint64 Rank = FMath::Max<uint64>(1, uint64(FMath::CeilToDouble(Percentile * Count)));
+	uint64 Cumulative = 0;
+	for (int32 BucketIndex = 0; BucketIndex < NbBuckets; BucketIndex++)
+	{
+		Cumulative += Buckets[BucketIndex].load(std::memory_order_relaxed);
+		if (Cumulative >= Rank)
+		{
+			// The max is more precise than the bound of the last bucket
+			return FMath::Min(GetBucketUpperBoundUs(BucketIndex), GetMaxUs());
+		}
+	}
+	return GetMaxUs();
+}
+
+double FLatencyHistogram::GetMaxUs() const
+{
+	return MaxUs.load(std::memory_order_relaxed);
+}
+
+int32 FLatencyHistogram::GetBucketIndex(double Us)
+{
+	// Bucket 0 is for everything under 1 us
+	if (Us < 1.0)
+	{
+		return 0;
+	}
+	return FMath::Min(NbBuckets - 1, 1 + int32(FMath::Log2(Us) * NbBucketsPerOctave));
+}
+
+double FLatencyHistogram::GetBucketUpperBoundUs(int32 BucketIndex)
+{
+	return FMath::Pow(2.0, double(BucketIndex) / NbBucketsPerOctave);
+}
+
+FLatencyHistograms& FLatencyHistograms::Get()
+{
+	static FLatencyHistograms Histograms;
+	return Histograms;
+}
+
+void FLatencyHistograms::Reset()
+{
+	for (FLatencyHistogram& Histogram : Histograms)
+	{
+		Histogram.Reset();
+	}
+}
+
+void FLatencyHistograms::PublishStats() const
+{
+	SET_LATENCY_STATS(Token)
+	SET_LATENCY_STATS(PreGenerate)
+	SET_LATENCY_STATS(Generate)
+	SET_LATENCY_STATS(PostGenerate)
+	SET_LATENCY_STATS(SearchStrategy)
+	SET_LATENCY_STATS(NoteConversion)
+	SET_LATENCY_STATS(BeatGeneration)
+	SET_LATENCY_STATS(Execute)
+}
+
+const TCHAR* FLatencyHistograms::GetStageName(ELatencyStage Stage)
+{
+	switch (Stage)
+	{
+		case ELatencyStage::Token: return TEXT("Token");
+		case ELatencyStage::PreGenerate: return TEXT("PreGenerate");
+		case ELatencyStage::Generate: return TEXT("Generate");
+		case ELatencyStage::PostGenerate: return TEXT("PostGenerate");
+		case ELatencyStage::SearchStrategy: return TEXT("SearchStrategy");
+		case ELatencyStage::NoteConversion: return TEXT("NoteConversion");
+		case ELatencyStage::BeatGeneration: return TEXT("BeatGeneration");
+		case ELatencyStage::Execute: return TEXT("Execute");
+		default: return TEXT("Unknown");
+	}
+}
+
+FString FLatencyHistograms::ToCSV() const
+{
+	FString CSV = TEXT("Stage,Count,P50Ms,P95Ms,P99Ms,MaxMs\n");
+	for (int32 StageIndex = 0; StageIndex < int32(ELatencyStage::Count); StageIndex++)
+	{
+		const FLatencyHistogram& Histogram = Histograms[StageIndex];
+		CSV += FString::Printf(TEXT("%s,%llu,%.4f,%.4f,%.4f,%.4f\n"),
+			GetStageName(ELatencyStage(StageIndex)), Histogram.GetCount(),
+			Histogram.GetPercentileUs(0.50) / 1000.0, Histogram.GetPercentileUs(0.95) / 1000.0,
+			Histogram.GetPercentileUs(0.99) / 1000.0, Histogram.GetMaxUs() / 1000.0);
+	}
+	return CSV;
+}
+
+FString FLatencyHistograms::ToJSON() const
+{
+	FString JSON = TEXT("{\n");
+	for (int32 StageIndex = 0; StageIndex < int32(ELatencyStage::Count); StageIndex++)
+	{
+		const FLatencyHistogram& Histogram = Histograms[StageIndex];
+		JSON += FString::Printf(TEXT("\t\"%s\": { \"count\": %llu, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f }%s\n"),
+			GetStageName(ELatencyStage(StageIndex)), Histogram.GetCount(),
+			Histogram.GetPercentileUs(0.50) / 1000.0, Histogram.GetPercentileUs(0.95) / 1000.0,
+			Histogram.GetPercentileUs(0.99) / 1000.0, Histogram.GetMaxUs() / 1000.0,
+			StageIndex + 1 < int32(ELatencyStage::Count) ? TEXT(",") : TEXT(""));
+	}
+	JSON += TEXT("}\n");
+	return JSON;
+}
+
+namespace LatencyHistogramCommands
+{
+	// Usage : MIDIGen.Latency.Dump [csv|json] [FilePath]
+	void Dump(const TArray<FString>& Args)
+	{
+		const bool bIsJSON = Args.Num() > 0 && Args[0].Equals(TEXT("json"), ESearchCase::IgnoreCase);
+		const FString Extension = bIsJSON ? TEXT("json") : TEXT("csv");
+		const FString FilePath = Args.Num() > 1
+			? Args[1]
+			: FPaths::ProfilingDir() / TEXT("MIDIGen") / FString::Printf(TEXT("Latency-%s.%s"), *FDateTime::Now().ToString(), *Extension);
+
+		const FLatencyHistograms& Histograms = FLatencyHistograms::Get();
+		const FString Content = bIsJSON ? Histograms.ToJSON() : Histograms.ToCSV();
+		if (FFileHelper::SaveStringToFile(Content, *FilePath))
+		{
+			UE_LOG(LogTemp, Display, TEXT("Latency histograms written to %s"), *FilePath);
+		}
+		else
+		{
+			UE_LOG(LogTemp, Error, TEXT("Couldn't write latency histograms to %s"), *FilePath);
+		}
+		UE_LOG(LogTemp, Display, TEXT("\n%s"), *Content);
+	}
+
+	void Reset()
+	{
+		FLatencyHistograms::Get().Reset();
+	}
+
+	FAutoConsoleCommand DumpCommand(
+		TEXT("MIDIGen.Latency.Dump"),
+		TEXT("Writes the p50/p95/p99/max latency of every generation stage. Usage : MIDIGen.Latency.Dump [csv|json] [FilePath]"),
+		FConsoleCommandWithArgsDelegate::CreateStatic(&Dump));
+
+	FAutoConsoleCommand ResetCommand(
+		TEXT("MIDIGen.Latency.Reset"),
+		TEXT("Clears the latency histograms of every generation stage."),
+		FConsoleCommandDelegate::CreateStatic(&Reset));
+}
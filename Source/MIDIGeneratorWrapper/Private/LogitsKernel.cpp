@@ -0,0 +1,238 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "LogitsKernel.h"
+
+int32 FLogitsKernel::Sample(const float* Logits, TArrayView<const FSpan> Spans, const float* CompactBias, int32 TopK, float TopP, float RandomValue)
+{
+	int32 NbAllowed = 0;
+	for (const FSpan& Span : Spans)
+	{
+		NbAllowed += Span.Size;
+	}
+
+	if (NbAllowed == 0 || TopK <= 0)
+	{
+		return -1;
+	}
+
+	// Pass 1 : gathers the allowed logits with their bias
+	Gather(Logits, Spans, CompactBias, CompactLogits);
+
+	// Pass 2 : top k over the compact logits, kept sorted in descending order
+	// k is small (~40), so an insertion into a sorted array beats a heap, and most values are rejected by the first comparison
+	TopK = FMath::Min(TopK, NbAllowed);
+	TopLogits.Reset();
+	TopCompactIndices.Reset();
+	const float* Compact = CompactLogits.GetData();
+	for (int32 i = 0; i < NbAllowed; i++)
+	{
+		const float Value = Compact[i];
+		if (TopLogits.Num() == TopK)
+		{
+			if (Value <= TopLogits.Last())
+			{
+				continue;
+			}
+			TopLogits.Pop(EAllowShrinking::No);
+			TopCompactIndices.Pop(EAllowShrinking::No);
+		}
+
+		int32 InsertIndex = TopLogits.Num();
+		while (InsertIndex > 0 && TopLogits[InsertIndex - 1] < Value)
+		{
+			InsertIndex--;
+		}
+		TopLogits.Insert(Value, InsertIndex);
+		TopCompactIndices.Insert(i, InsertIndex);
+	}
+
+	// Pass 3 : stable softmax over the top k
+	const int32 NbTop = TopLogits.Num();
+	float* Top = TopLogits.GetData();
+	const float MaxValue = Top[0];
+	const VectorRegister4Float MaxLogit = VectorSetFloat1(MaxValue);
+	VectorRegister4Float SumVector = VectorZeroFloat();
+	int32 i = 0;
+	for (; i + 4 <= NbTop; i += 4)
+	{
+		const VectorRegister4Float Exp = VectorExp(VectorSubtract(VectorLoad(Top + i), MaxLogit));
+		VectorStore(Exp, Top + i);
+		SumVector = VectorAdd(SumVector, Exp);
+	}
+	float Sums[4];
+	VectorStore(SumVector, Sums);
+	float Sum = Sums[0] + Sums[1] + Sums[2] + Sums[3];
+	for (; i < NbTop; i++)
+	{
+		Top[i] = FMath::Exp(Top[i] - MaxValue);
+		Sum += Top[i];
+	}
+
+	// Pass 4 : top p, the probabilities are already sorted
+	const float InvSum = 1.0f / Sum;
+	float Cumulative = 0.0f;
+	int32 NbCandidates = 0;
+	while (NbCandidates < NbTop)
+	{
+		Cumulative += Top[NbCandidates] * InvSum;
+		NbCandidates++;
+		if (Cumulative >= TopP)
+		{
+			break;
+		}
+	}
+
+	float Threshold = RandomValue * Cumulative;
+	int32 SelectedCompactIndex = TopCompactIndices[NbCandidates - 1];
+	for (int32 Candidate = 0; Candidate < NbCandidates; Candidate++)
+	{
+		Threshold -= Top[Candidate] * InvSum;
+		if (Threshold < 0.0f)
+		{
+			SelectedCompactIndex = TopCompactIndices[Candidate];
+			break;
+		}
+	}
+
+	return CompactIndexToToken(Spans, SelectedCompactIndex);
+}
+
+void FLogitsKernel::Gather(const float* Logits, TArrayView<const FSpan> Spans, const float* CompactBias, TArray<float>& OutCompactLogits)
+{
+	int32 NbAllowed = 0;
+	for (const FSpan& Span : Spans)
+	{
+		NbAllowed += Span.Size;
+	}
+	OutCompactLogits.SetNumUninitialized(NbAllowed, EAllowShrinking::No);
+
+	// Contiguous spans are loaded 4 at a time
+	float* Compact = OutCompactLogits.GetData();
+	const float* SpanBias = CompactBias;
+	for (const FSpan& Span : Spans)
+	{
+		const float* SpanLogits = Logits + Span.Begin;
+		int32 i = 0;
+		if (SpanBias != nullptr)
+		{
+			for (; i + 4 <= Span.Size; i += 4)
+			{
+				VectorStore(VectorAdd(VectorLoad(SpanLogits + i), VectorLoad(SpanBias + i)), Compact + i);
+			}
+			for (; i < Span.Size; i++)
+			{
+				Compact[i] = SpanLogits[i] + SpanBias[i];
+			}
+			SpanBias += Span.Size;
+		}
+		else
+		{
+			FMemory::Memcpy(Compact, SpanLogits, Span.Size * sizeof(float));
+		}
+		Compact += Span.Size;
+	}
+}
+
+int32 FLogitsKernel::CompactIndexToToken(TArrayView<const FSpan> Spans, int32 CompactIndex)
+{
+	for (const FSpan& Span : Spans)
+	{
+		if (CompactIndex < Span.Size)
+		{
+			return Span.Begin + CompactIndex;
+		}
+		CompactIndex -= Span.Size;
+	}
+	return -1;
+}
+
+#if !UE_BUILD_SHIPPING
+#include "HAL/IConsoleManager.h"
+#include "gen.h"
+#include "range.h"
+#include "logitProcessing.h"
+
+namespace LogitsKernelBenchmark
+{
+	// Usage : MIDIGen.Bench.Sampling [NbIterations]
+	void Run(const TArray<FString>& Args)
+	{
+		const int32 NbIterations = Args.Num() > 0 ? FMath::Max(1, FCString::Atoi(*Args[0])) : 2000;
+		const int32 VocabSize = 50257;
+		const int32 TopK = 40;
+		const float TopP = 0.5f;
+
+		FRandomStream Random(1234);
+		TArray<float> PristineLogits;
+		PristineLogits.SetNumUninitialized(VocabSize);
+		for (float& Logit : PristineLogits)
+		{
+			Logit = Random.FRandRange(-10.0f, 10.0f);
+		}
+		// stableSoftmax overwrites the logits, both paths sample from a fresh copy of the allowed ones each iteration
+		TArray<float> Logits = PristineLogits;
+		auto RestoreLogits = [&Logits, &PristineLogits](TArrayView<const FLogitsKernel::FSpan> Spans)
+		{
+			for (const FLogitsKernel::FSpan& Span : Spans)
+			{
+				FMemory::Memcpy(Logits.GetData() + Span.Begin, PristineLogits.GetData() + Span.Begin, Span.Size * sizeof(float));
+			}
+		};
+
+		// Similar to the pitch + time shift range group
+		RangeGroupHandle RangeGroup = createRangeGroup();
+		rangeGroupAddRange(RangeGroup, 4, 91);
+		rangeGroupAddRange(RangeGroup, 220, 411);
+		rangeGroupAddRange(RangeGroup, 1000, 1063);
+		rangeGroupUpdateCache(RangeGroup);
+
+		const Range* Ranges;
+		size_t NbRanges;
+		rangeGroupGetRanges(RangeGroup, &Ranges, &NbRanges);
+		TArray<FLogitsKernel::FSpan> Spans;
+		for (size_t i = 0; i < NbRanges; i++)
+		{
+			Spans.Add(FLogitsKernel::FSpan{ Ranges[i].min, int32(rangeSize(&Ranges[i])) });
+		}
+
+		const size_t RangeGroupSize = rangeGroupSize(RangeGroup);
+		TArray<float> CompactBias;
+		CompactBias.SetNumZeroed(RangeGroupSize);
+		TArray<int32> Indices;
+
+		double StartTime = FPlatformTime::Seconds();
+		int32 Checksum = 0;
+		for (int32 Iteration = 0; Iteration < NbIterations; Iteration++)
+		{
+			RestoreLogits(Spans);
+			rangeGroupUpdateCache(RangeGroup);
+			Indices.SetNumUninitialized(RangeGroupSize);
+			rangeGroupWrite(RangeGroup, Indices.GetData());
+			sortLogits(Logits.GetData(), Indices.GetData(), Indices.GetData() + RangeGroupSize, TopK);
+			stableSoftmax(Logits.GetData(), Indices.GetData(), Indices.GetData() + TopK);
+			Checksum += topPSampling(Logits.GetData(), Indices.GetData(), Indices.GetData() + TopK, TopP);
+		}
+		const double LibraryUs = (FPlatformTime::Seconds() - StartTime) * 1e6 / NbIterations;
+
+		FLogitsKernel Kernel;
+		StartTime = FPlatformTime::Seconds();
+		for (int32 Iteration = 0; Iteration < NbIterations; Iteration++)
+		{
+			RestoreLogits(Spans);
+			Checksum += Kernel.Sample(Logits.GetData(), Spans, CompactBias.GetData(), TopK, TopP, Random.FRand());
+		}
+		const double FusedUs = (FPlatformTime::Seconds() - StartTime) * 1e6 / NbIterations;
+
+		destroyRangeGroup(RangeGroup);
+
+		UE_LOG(LogTemp, Display, TEXT("Sampling | %d allowed tokens, top %d, top p %.2f | Library: %7.2f us/token | Fused: %7.2f us/token (checksum %d)"),
+			int32(RangeGroupSize), TopK, TopP, LibraryUs, FusedUs, Checksum);
+	}
+
+	FAutoConsoleCommand Command(
+		TEXT("MIDIGen.Bench.Sampling"),
+		TEXT("Cost of sampling a token from the logits of a range group, library functions vs FLogitsKernel."),
+		FConsoleCommandWithArgsDelegate::CreateStatic(&Run));
+}
+#endif
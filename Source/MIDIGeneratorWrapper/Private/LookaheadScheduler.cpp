@@ -0,0 +1,69 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "LookaheadScheduler.h"
+
+void FLookaheadScheduler::RecordToken(double TokenMs, int32 HistoryTick)
+{
+	AverageTokenMs = AverageTokenMs == 0.0 ? TokenMs : FMath::Lerp(AverageTokenMs, TokenMs, SmoothingFactor);
+	NbTokensSinceLastTick++;
+
+	// The history went back after a rewind, start measuring again from there
+	if (LastTick == INDEX_NONE || HistoryTick < LastTick)
+	{
+		LastTick = HistoryTick;
+		NbTokensSinceLastTick = 0;
+	}
+	else if (HistoryTick > LastTick)
+	{
+		const double TokensPerTick = double(NbTokensSinceLastTick) / (HistoryTick - LastTick);
+		AverageTokensPerTick = AverageTokensPerTick == 0.0 ? TokensPerTick : FMath::Lerp(AverageTokensPerTick, TokensPerTick, SmoothingFactor);
+		LastTick = HistoryTick;
+		NbTokensSinceLastTick = 0;
+	}
+
+	SET_FLOAT_STAT(STAT_GenThread_TokensPerSecond, AverageTokenMs > 0.0 ? 1000.0 / AverageTokenMs : 0.0);
+	SET_FLOAT_STAT(STAT_GenThread_TokensPerTick, AverageTokensPerTick);
+
+	GenerationMsPerTick.store(float(AverageTokenMs * AverageTokensPerTick), std::memory_order_relaxed);
+
+	UpdateThresholds();
+}
+
+void FLookaheadScheduler::SetMsPerTick(float InMsPerTick)
+{
+	if (InMsPerTick > 0.0f && InMsPerTick != MsPerTick.load(std::memory_order_relaxed))
+	{
+		MsPerTick.store(InMsPerTick, std::memory_order_relaxed);
+		UpdateThresholds();
+	}
+}
+
+void FLookaheadScheduler::SetTargetLookahead(float InTargetLookaheadMs, float InHysteresisMs)
+{
+	TargetLookaheadMs.store(FMath::Max(0.0f, InTargetLookaheadMs), std::memory_order_relaxed);
+	HysteresisMs.store(FMath::Max(0.0f, InHysteresisMs), std::memory_order_relaxed);
+	UpdateThresholds();
+}
+
+void FLookaheadScheduler::UpdateThresholds()
+{
+	const float CurrentMsPerTick = MsPerTick.load(std::memory_order_relaxed);
+	if (CurrentMsPerTick <= 0.0f)
+	{
+		return;
+	}
+
+	// When a tick takes longer to generate than to play, the lookahead runs out faster than it's refilled,
+	// so more of it is needed to get through a passage with a lot of notes
+	const double Slowdown = FMath::Max(1.0, double(GenerationMsPerTick.load(std::memory_order_relaxed)) / CurrentMsPerTick);
+
+	const double ResumeMs = TargetLookaheadMs.load(std::memory_order_relaxed) * Slowdown;
+	const double SleepMs = ResumeMs + HysteresisMs.load(std::memory_order_relaxed);
+
+	const int32 NewResumeTicksAhead = FMath::Max(1, FMath::CeilToInt32(ResumeMs / CurrentMsPerTick));
+	const int32 NewSleepTicksAhead = FMath::Max(NewResumeTicksAhead + 1, FMath::CeilToInt32(SleepMs / CurrentMsPerTick));
+	TicksAhead.store(PackTicksAhead(NewResumeTicksAhead, NewSleepTicksAhead), std::memory_order_relaxed);
+
+	SET_FLOAT_STAT(STAT_GenThread_TargetLookaheadMs, ResumeMs);
+}
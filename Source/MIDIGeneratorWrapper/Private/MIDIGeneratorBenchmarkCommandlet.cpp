@@ -0,0 +1,171 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "MIDIGeneratorBenchmarkCommandlet.h"
+#include "MIDIGeneratorEnv.h"
+#include "GenThread.h"
+#include "LatencyHistogram.h"
+#include "TokenizerRegistry.h"
+#include "HAL/PlatformMemory.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+UMIDIGeneratorBenchmarkCommandlet::UMIDIGeneratorBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsEditor = false;
+	IsServer = false;
+	LogToConsole = true;
+}
+
+int32 UMIDIGeneratorBenchmarkCommandlet::Main(const FString& Params)
+{
+	FString ModelPath;
+	FString TokenizerPath;
+	if (!FParse::Value(*Params, TEXT("Model="), ModelPath) || !FParse::Value(*Params, TEXT("Tokenizer="), TokenizerPath))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Usage : -run=MIDIGeneratorBenchmark -Model=<ModelFolder> -Tokenizer=<TokenizerJson> [-Tokens=512] [-WarmUp=32] [-Voices=1] [-Prompt=1,2,3] [-Timeout=600] [-Output=<File.json>]"));
+		return 1;
+	}
+
+	int32 NbTokens = 512;
+	int32 NbWarmUpTokens = 32;
+	int32 NbVoices = 1;
+	double TimeoutSeconds = 600.0;
+	FString PromptStr;
+	FString OutputPath;
+	FParse::Value(*Params, TEXT("Tokens="), NbTokens);
+	FParse::Value(*Params, TEXT("WarmUp="), NbWarmUpTokens);
+	FParse::Value(*Params, TEXT("Voices="), NbVoices);
+	FParse::Value(*Params, TEXT("Timeout="), TimeoutSeconds);
+	FParse::Value(*Params, TEXT("Prompt="), PromptStr, false);
+	FParse::Value(*Params, TEXT("Output="), OutputPath);
+
+	TArray<int32> Prompt;
+	TArray<FString> PromptTokens;
+	PromptStr.ParseIntoArray(PromptTokens, TEXT(","));
+	for (const FString& Token : PromptTokens)
+	{
+		Prompt.Add(FCString::Atoi(*Token));
+	}
+	if (Prompt.IsEmpty())
+	{
+		// BOS
+		Prompt.Add(1);
+	}
+
+	const FString AbsoluteTokenizerPath = FGenThread::RelativeToAbsoluteContentPath(TokenizerPath);
+	FTokenizerPtr Tok = FTokenizerRegistry::Get().FindOrLoad(AbsoluteTokenizerPath);
+	if (!Tok.IsValid())
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load the tokenizer %s"), *AbsoluteTokenizerPath);
+		return 1;
+	}
+
+	TSharedPtr<FMIDIGeneratorEnv> Env = MakeShared<FMIDIGeneratorEnv>();
+	Env->SetNbVoices(NbVoices);
+	Env->GenThread->SetTok(MakeShared<FTokenizerProxy, ESPMode::ThreadSafe>(Tok));
+	Env->GenThread->SetFreeRunning(true);
+	Env->SetTokens(Prompt);
+
+	const int64 MemoryBeforeLoad = FPlatformMemory::GetStats().UsedPhysical;
+	double StartTime = FPlatformTime::Seconds();
+	if (!Env->PreloadPipeline(ModelPath))
+	{
+		return 1;
+	}
+	const double LoadSeconds = FPlatformTime::Seconds() - StartTime;
+	const int64 MemoryAfterLoad = FPlatformMemory::GetStats().UsedPhysical;
+
+	FLatencyHistograms::Get().Reset();
+	// The process peak includes whatever ran before, only what generation adds on top of the loaded model is measured
+	const int64 MemoryBeforeGeneration = FPlatformMemory::GetStats().UsedPhysical;
+	int64 PeakGenerationMemory = MemoryBeforeGeneration;
+	StartTime = FPlatformTime::Seconds();
+	Env->StartGeneration();
+
+	// Consumes what the audio thread would, tokens are counted on the first voice
+	double FirstTokenSeconds = -1.0;
+	double WarmUpEndSeconds = StartTime;
+	int32 NbGeneratedTokens = 0;
+	int32 NbGeneratedEvents = 0;
+	bool bHasTimedOut = false;
+	while (NbGeneratedTokens < NbWarmUpTokens + NbTokens)
+	{
+		FGeneratedToken NewToken;
+		while (Env->GenThread->GeneratedTokens.Pop(NewToken))
+		{
+			if (NewToken.BatchIndex != 0)
+			{
+				continue;
+			}
+
+			NbGeneratedTokens++;
+			PeakGenerationMemory = FMath::Max(PeakGenerationMemory, int64(FPlatformMemory::GetStats().UsedPhysical));
+			const double Now = FPlatformTime::Seconds();
+			if (FirstTokenSeconds < 0.0)
+			{
+				FirstTokenSeconds = Now - StartTime;
+			}
+			if (NbGeneratedTokens == NbWarmUpTokens)
+			{
+				// Only the steady state is measured
+				WarmUpEndSeconds = Now;
+				FLatencyHistograms::Get().Reset();
+			}
+		}
+
+		FGeneratedMidiEvent NewEvent;
+		while (Env->GeneratedEvents.Pop(NewEvent))
+		{
+			NbGeneratedEvents++;
+		}
+
+		if (FPlatformTime::Seconds() - StartTime > TimeoutSeconds)
+		{
+			bHasTimedOut = true;
+			break;
+		}
+		FPlatformProcess::Sleep(0.0005f);
+	}
+	const double EndSeconds = FPlatformTime::Seconds();
+
+	Env->StopGeneration();
+	// Joins the gen thread while the env it calls back is still alive
+	Env->GenThread.Reset();
+
+	const int32 NbMeasuredTokens = FMath::Max(0, NbGeneratedTokens - NbWarmUpTokens);
+	const double MeasuredSeconds = EndSeconds - WarmUpEndSeconds;
+	const double TokensPerSecond = MeasuredSeconds > 0.0 ? NbMeasuredTokens / MeasuredSeconds : 0.0;
+	const FLatencyHistogram& TokenLatency = FLatencyHistograms::Get().GetHistogram(ELatencyStage::Token);
+	const int64 GenerationMemory = PeakGenerationMemory - MemoryBeforeGeneration;
+
+	UE_LOG(LogTemp, Display, TEXT("Benchmark | %s | %d voice(s) | %d tokens after %d warm-up tokens%s"),
+		*ModelPath, NbVoices, NbMeasuredTokens, NbWarmUpTokens, bHasTimedOut ? TEXT(" | TIMED OUT") : TEXT(""));
+	UE_LOG(LogTemp, Display, TEXT("Load: %.2f s | Time to first token: %.2f ms | %.2f tokens/s | %d MIDI events"),
+		LoadSeconds, FirstTokenSeconds * 1000.0, TokensPerSecond, NbGeneratedEvents);
+	UE_LOG(LogTemp, Display, TEXT("Token latency | p50: %.2f ms | p95: %.2f ms | p99: %.2f ms | max: %.2f ms"),
+		TokenLatency.GetPercentileUs(0.50) / 1000.0, TokenLatency.GetPercentileUs(0.95) / 1000.0,
+		TokenLatency.GetPercentileUs(0.99) / 1000.0, TokenLatency.GetMaxUs() / 1000.0);
+	UE_LOG(LogTemp, Display, TEXT("Memory | model: %.1f MB | generation peak: %.1f MB"),
+		double(MemoryAfterLoad - MemoryBeforeLoad) / (1024.0 * 1024.0), double(GenerationMemory) / (1024.0 * 1024.0));
+	UE_LOG(LogTemp, Display, TEXT("\n%s"), *FLatencyHistograms::Get().ToCSV());
+
+	if (!OutputPath.IsEmpty())
+	{
+		const FString JSON = FString::Printf(TEXT("{\n\"model\": \"%s\",\n\"voices\": %d,\n\"tokens\": %d,\n\"warm_up_tokens\": %d,\n\"timed_out\": %s,\n")
+			TEXT("\"load_s\": %.4f,\n\"time_to_first_token_ms\": %.4f,\n\"tokens_per_second\": %.4f,\n")
+			TEXT("\"model_memory_mb\": %.2f,\n\"generation_peak_memory_mb\": %.2f,\n\"latency\": %s}\n"),
+			*ModelPath.ReplaceCharWithEscapedChar(), NbVoices, NbMeasuredTokens, NbWarmUpTokens, bHasTimedOut ? TEXT("true") : TEXT("false"),
+			LoadSeconds, FirstTokenSeconds * 1000.0, TokensPerSecond,
+			double(MemoryAfterLoad - MemoryBeforeLoad) / (1024.0 * 1024.0), double(GenerationMemory) / (1024.0 * 1024.0),
+			*FLatencyHistograms::Get().ToJSON());
+		if (!FFileHelper::SaveStringToFile(JSON, *OutputPath))
+		{
+			UE_LOG(LogTemp, Error, TEXT("Couldn't write the results to %s"), *OutputPath);
+			return 1;
+		}
+	}
+
+	return bHasTimedOut ? 1 : 0;
+}
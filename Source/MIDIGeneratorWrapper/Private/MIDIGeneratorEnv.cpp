@@ -3,6 +3,10 @@
 
 #include "MIDIGeneratorEnv.h"
 #include "GenThread.h"
+#include "MIDIModelPool.h"
+#include "LatencyHistogram.h"
+#include "Async/Async.h"
+#include "Algo/BinarySearch.h"
 #include "HarmonixMetasound/DataTypes/MidiClock.h"
 #include "HarmonixMetasound/DataTypes/MusicTimeInterval.h"
 
@@ -15,6 +19,7 @@
 #include "generationHistory.h"
 #include "onAddTokensArgs.hpp"
 #include "midiConverter.h"
+#include "range.h"
 
 #define IS_VERSION(MAJOR, MINOR) (ENGINE_MAJOR_VERSION == MAJOR) && (ENGINE_MINOR_VERSION == MINOR)
 #define IS_VERSION_OR_PREV(MAJOR, MINOR) (ENGINE_MAJOR_VERSION == MAJOR) && (ENGINE_MINOR_VERSION <= MINOR)
@@ -36,8 +41,21 @@ FMIDIGeneratorProxy::FMIDIGeneratorProxy(const TSharedPtr<FMIDIGeneratorEnv>& In
 	}
 }
 
+FMIDIRangeGroups::~FMIDIRangeGroups()
+{
+	for (RangeGroupHandle RangeGroup : { BaseRangeGroup, PitchTimeshiftRangeGroup, PitchRangeGroup, VelocityRangeGroup, DurationRangeGroup, TimeShiftRangeGroup, AllRangeGroup })
+	{
+		if (RangeGroup)
+		{
+			destroyRangeGroup(RangeGroup);
+		}
+	}
+}
+
 FMIDIGeneratorEnv::~FMIDIGeneratorEnv()
 {
+	delete PendingSamplingSetup.exchange(nullptr);
+
 	//if (RangeGroup)
 	//{
 	//	destroyRangeGroup(RangeGroup);
@@ -49,30 +67,100 @@ void FMIDIGeneratorEnv::PreStart(const FString& TokenizerPath, const FString& Mo
 	GenThread->PreStart(TokenizerPath, ModelPath, InTokens);
 }
 
-void FMIDIGeneratorEnv::PreloadPipeline(const FString& ModelPath)
+bool FMIDIGeneratorEnv::PreloadPipeline(const FString& ModelPath)
 {
-	const char* Path = TCHAR_TO_UTF8(*GenThread->RelativeToAbsoluteContentPath(ModelPath));
+	// Generators using the same model share its weights, only the pipeline is per running generator
+	FPooledMIDIModelPtr Model = FMIDIModelPool::Get().FindOrLoad(GenThread->RelativeToAbsoluteContentPath(ModelPath));
+	if (!Model.IsValid())
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load the model %s"), *ModelPath);
+		return false;
+	}
 
-	EnvHandle env = createEnv(false);
+	// The running pipeline can't be swapped, the gen thread uses it without locking
+	PipelineLoadingMutex.Lock();
+	const bool bHasStarted = GenThread->HasStarted();
+	if (!bHasStarted)
+	{
+		GenThread->SetPipeline(Model->AcquirePipeline());
+	}
+	PipelineLoadingMutex.Unlock();
+
+	UE_CLOG(bHasStarted, LogTemp, Warning, TEXT("The generation has already started, ignoring the model %s"), *ModelPath);
+	return !bHasStarted;
+}
 
-	ModelLoadingParamsWrapper params;
-	CResult r = createModelLoadingParamsWrapperFromFolder(Path, &params);
-	if (!ResultIsSuccess(&r))
+void FMIDIGeneratorEnv::PreloadPipelineAsync(const FString& ModelPath, TFunction<void(float Progress)> OnProgress, TFunction<void(bool bSuccess)> OnCompleted)
+{
+	PipelineLoadingMutex.Lock();
+	if (bIsPipelineLoading)
 	{
-		verify(false); // couldn't load file
+		PipelineLoadingMutex.Unlock();
+		UE_LOG(LogTemp, Warning, TEXT("A pipeline is already being loaded, ignoring %s"), *ModelPath);
 		return;
 	}
+	bIsPipelineLoading = true;
+	PipelineLoadingMutex.Unlock();
+
+	TWeakPtr<FMIDIGeneratorEnv, ESPMode::ThreadSafe> WeakThis = AsShared();
+	FString AbsoluteModelPath = GenThread->RelativeToAbsoluteContentPath(ModelPath);
+
+	Async(EAsyncExecution::ThreadPool, [WeakThis, AbsoluteModelPath, OnProgress = MoveTemp(OnProgress), OnCompleted = MoveTemp(OnCompleted)]()
+		{
+			// The library doesn't report loading progress, so only the loading steps are reported
+			if (OnProgress)
+			{
+				OnProgress(0.0f);
+			}
+
+			FPooledMIDIModelPtr Model = FMIDIModelPool::Get().FindOrLoad(AbsoluteModelPath);
+			if (OnProgress && Model.IsValid())
+			{
+				OnProgress(0.9f);
+			}
+
+			bool bIsAdopted = false;
+			TSharedPtr<FMIDIGeneratorEnv, ESPMode::ThreadSafe> This = WeakThis.Pin();
+			if (This.IsValid())
+			{
+				// Started under the lock, so a generation can't start while the pipeline is set
+				This->PipelineLoadingMutex.Lock();
+				const bool bHasStarted = This->GenThread->HasStarted();
+				if (Model.IsValid() && !bHasStarted)
+				{
+					This->GenThread->SetPipeline(Model->AcquirePipeline());
+					bIsAdopted = true;
+					if (This->bIsStartQueued)
+					{
+						This->GenThread->Start();
+					}
+				}
+				This->bIsPipelineLoading = false;
+				This->bIsStartQueued = false;
+				This->PipelineLoadingMutex.Unlock();
 
-	//CStr ModelType = modelLoadingParams_getModelType(&params);
-	CppStr ModelType = params.getModelType();
-	OnnxModelBuilder* Builder = getModelBuilderManager().findBuilder<OnnxModelBuilder>(ModelType.Str());
-	Builder->env = env;
+				// The running pipeline can't be swapped, the gen thread uses it without locking
+				UE_CLOG(Model.IsValid() && bHasStarted, LogTemp, Warning, TEXT("The generation has already started, ignoring the model %s"), *AbsoluteModelPath);
+			}
 
-	AModel* Model = Builder->loadModelFromWrapper(params);
-	IPipeline* Pipeline = Model->createPipeline();
-	IAutoRegressivePipeline* ARPipeline = (IAutoRegressivePipeline*)Pipeline; // @TODO : dynamic cast
+			if (OnProgress && Model.IsValid())
+			{
+				OnProgress(1.0f);
+			}
+
+			if (OnCompleted)
+			{
+				OnCompleted(bIsAdopted);
+			}
+		});
+}
 
-	GenThread->SetPipeline(ARPipeline);	
+bool FMIDIGeneratorEnv::IsPipelineLoading()
+{
+	PipelineLoadingMutex.Lock();
+	bool bIsLoading = bIsPipelineLoading;
+	PipelineLoadingMutex.Unlock();
+	return bIsLoading;
 }
 
 void FMIDIGeneratorEnv::SetTokens(const TArray<int32>& InTokens)
@@ -80,18 +168,380 @@ void FMIDIGeneratorEnv::SetTokens(const TArray<int32>& InTokens)
 	GenThread->SetTokens(InTokens);
 }
 
-void FMIDIGeneratorEnv::UpdateCurrentRangeGroup(int32 LastDecodedToken)
+void FMIDIGeneratorEnv::SetNbVoices(int32 InNbVoices)
+{
+	NbVoices = FMath::Max(1, InNbVoices);
+	GenThread->SetNbBatches(NbVoices + Branches.Num());
+}
+
+int32 FMIDIGeneratorEnv::AddBranch(const FMIDIGenerationSettings& Settings)
+{
+	SettingsMutex.Lock();
+	int32 BranchIndex = Branches.Add(FMIDIGeneratorBranch{ Settings });
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+
+	GenThread->SetNbBatches(NbVoices + Branches.Num());
+	return BranchIndex;
+}
+
+void FMIDIGeneratorEnv::SwitchToBranch(int32 BranchIndex)
+{
+	SettingsMutex.Lock();
+	if (!Branches.IsValidIndex(BranchIndex))
+	{
+		SettingsMutex.Unlock();
+		return;
+	}
+
+	// The played line keeps being generated as a branch, with the settings that were current
+	FMIDIGeneratorBranch& Branch = Branches[BranchIndex];
+	FMIDIGenerationSettings PlayedSettings;
+	GetSettings(PlayedSettings);
+	ApplySettings(Branch.Settings);
+	Branch.Settings = PlayedSettings;
+	Swap(MainVoiceBatchIndex, Branch.BatchIndex);
+	if (PenaltyTables.IsValidIndex(1 + BranchIndex))
+	{
+		Swap(PenaltyTables[0], PenaltyTables[1 + BranchIndex]);
+	}
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+
+	// Applied before the next token, even if the gen thread is ahead
+	if (GenThread->Semaphore)
+	{
+		GenThread->Semaphore->Trigger();
+	}
+}
+
+void FMIDIGeneratorEnv::GetSettings(FMIDIGenerationSettings& OutSettings) const
+{
+	OutSettings.MinPitch = minPitch;
+	OutSettings.MaxPitch = maxPitch;
+	OutSettings.MinTimeShift = minTimeShift;
+	OutSettings.MaxTimeShift = maxTimeShift;
+	OutSettings.bUseScale = Scale != nullptr;
+	OutSettings.Scale = CurrentScale;
+}
+
+void FMIDIGeneratorEnv::SetSettings(const FMIDIGenerationSettings& Settings)
+{
+	SettingsMutex.Lock();
+	ApplySettings(Settings);
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+}
+
+void FMIDIGeneratorEnv::SetScale(EScale InScale)
+{
+	SettingsMutex.Lock();
+	CurrentScale = InScale;
+	GetScaleNotes(InScale, Scale, ScaleSize);
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+}
+
+void FMIDIGeneratorEnv::SetPitchRange(int32 MinPitch, int32 MaxPitch)
+{
+	SettingsMutex.Lock();
+	minPitch = MinPitch;
+	maxPitch = MaxPitch;
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+}
+
+void FMIDIGeneratorEnv::SetTimeShiftRange(float MinTimeShift, float MaxTimeShift)
+{
+	SettingsMutex.Lock();
+	minTimeShift = MinTimeShift;
+	maxTimeShift = MaxTimeShift;
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+}
+
+void FMIDIGeneratorEnv::GetScaleNotes(EScale InScale, const int32_t*& OutScale, int32_t& OutScaleSize)
+{
+	using namespace Scales;
+	switch (InScale)
+	{
+		case EScale::IonianMajor:
+			OutScale = Ionian::Major::get();
+			OutScaleSize = Ionian::Major::size();
+			break;
+		case EScale::Mixolydian:
+			OutScale = Mixolydian::get();
+			OutScaleSize = Mixolydian::size();
+			break;
+		case EScale::MelodicMinor:
+			OutScale = Melodic::Minor::get();
+			OutScaleSize = Melodic::Minor::size();
+			break;
+		case EScale::HarmonicMinor:
+			OutScale = Harmonic::Minor::get();
+			OutScaleSize = Harmonic::Minor::size();
+			break;
+		case EScale::WholeTone:
+			OutScale = WholeTone::get();
+			OutScaleSize = WholeTone::size();
+			break;
+		case EScale::Blues:
+			OutScale = Blues::get();
+			OutScaleSize = Blues::size();
+			break;
+		case EScale::PentatonicMajor:
+			OutScale = Pentatonic::Major::get();
+			OutScaleSize = Pentatonic::Major::size();
+			break;
+		case EScale::PentatonicMinor:
+			OutScale = Pentatonic::Minor::get();
+			OutScaleSize = Pentatonic::Minor::size();
+			break;
+		case EScale::HungarianMinor:
+			OutScale = Hungarian::Minor::get();
+			OutScaleSize = Hungarian::Minor::size();
+			break;
+		case EScale::Byzantine:
+			OutScale = Byzantine::get();
+			OutScaleSize = Byzantine::size();
+			break;
+		case EScale::Diminished:
+			OutScale = Diminished::get();
+			OutScaleSize = Diminished::size();
+			break;
+	}
+}
+
+void FMIDIGeneratorEnv::ApplySettings(const FMIDIGenerationSettings& Settings)
+{
+	minPitch = Settings.MinPitch;
+	maxPitch = Settings.MaxPitch;
+	minTimeShift = Settings.MinTimeShift;
+	maxTimeShift = Settings.MaxTimeShift;
+	CurrentScale = Settings.Scale;
+	if (Settings.bUseScale)
+	{
+		GetScaleNotes(Settings.Scale, Scale, ScaleSize);
+	}
+	else
+	{
+		Scale = nullptr;
+		ScaleSize = 0;
+	}
+}
+
+void FMIDIGeneratorEnv::ApplyPenaltyTransforms(float* Logits, RangeGroupHandle RangeGroup, const FMIDIGenerationSettings& Settings) const
+{
+	MidiTokenizerHandle Tok = GenThread->GetTok().GetTokenizer();
+
+	const int32_t* SettingsScale = nullptr;
+	int32_t SettingsScaleSize = 0;
+	if (Settings.bUseScale)
+	{
+		GetScaleNotes(Settings.Scale, SettingsScale, SettingsScaleSize);
+	}
+
+	if (SettingsScale != nullptr && SettingsScaleSize != 0)
+	{
+		musicalScalePenaltyTransform(Logits, RangeGroup, SettingsScale, SettingsScaleSize, 1.05, Tok);
+	}
+	pitchRangePenaltyTransform(Logits, RangeGroup, Settings.MinPitch, Settings.MaxPitch, 8.0, Tok);
+	timeShiftRangePenaltyTransform(Logits, RangeGroup, Settings.MinTimeShift, Settings.MaxTimeShift, 1.05, Tok);
+}
+
+const FRangeGroupMask& FMIDIGeneratorEnv::GetRangeGroupMask(RangeGroupHandle RangeGroup) const
+{
+	return SamplingSetup->RangeGroups->Masks.FindChecked(RangeGroup);
+}
+
+const TArray<FLogitsKernel::FSpan>& FMIDIGeneratorEnv::GetRangeGroupSpans(RangeGroupHandle RangeGroup) const
+{
+	return GetRangeGroupMask(RangeGroup).GetSpans();
+}
+
+FMIDIPenaltyTablesPtr FMIDIGeneratorEnv::BuildPenaltyTables(const FMIDIGenerationSettings& Settings) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_GenThread_BuildPenaltyTable);
+
+	TSharedPtr<FMIDIPenaltyTables, ESPMode::ThreadSafe> NewTables = MakeShared<FMIDIPenaltyTables, ESPMode::ThreadSafe>();
+	NewTables->Settings = Settings;
+
+	if (!RangeGroups.IsValid())
+	{
+		return NewTables;
+	}
+
+	TArray<float> ProbeLogits;
+	for (const TPair<RangeGroupHandle, FRangeGroupMask>& RangeGroupMask : RangeGroups->Masks)
+	{
+		const RangeGroupHandle RangeGroup = RangeGroupMask.Key;
+		const TArray<FLogitsKernel::FSpan>& Spans = RangeGroupMask.Value.GetSpans();
+
+		// The transforms are run on constant logits,
+		// they are additive if shifting their input shifts their output by the same amount for every token
+		const float ProbeValues[] = { 0.0f, 1.0f, -1.0f };
+		TArray<float> ProbeOutputs[UE_ARRAY_COUNT(ProbeValues)];
+		ProbeLogits.SetNumUninitialized(RangeGroupMask.Value.GetVocabSize(), EAllowShrinking::No);
+		for (int32 Probe = 0; Probe < UE_ARRAY_COUNT(ProbeValues); Probe++)
+		{
+			for (const FLogitsKernel::FSpan& Span : Spans)
+			{
+				for (int32 Token = Span.Begin; Token < Span.Begin + Span.Size; Token++)
+				{
+					ProbeLogits[Token] = ProbeValues[Probe];
+				}
+			}
+
+			ApplyPenaltyTransforms(ProbeLogits.GetData(), RangeGroup, Settings);
+
+			FLogitsKernel::Gather(ProbeLogits.GetData(), Spans, nullptr, ProbeOutputs[Probe]);
+		}
+
+		FMIDIPenaltyTable& Table = NewTables->Tables.Add(RangeGroup);
+		Table.bIsAdditive = true;
+		for (int32 i = 0; i < ProbeOutputs[0].Num(); i++)
+		{
+			if (!FMath::IsNearlyEqual(ProbeOutputs[1][i] - ProbeOutputs[0][i], 1.0f, 1e-3f)
+				|| !FMath::IsNearlyEqual(ProbeOutputs[0][i] - ProbeOutputs[2][i], 1.0f, 1e-3f))
+			{
+				Table.bIsAdditive = false;
+				UE_LOG(LogTemp, Log, TEXT("Penalties aren't additive for token %d, they are applied by the library on each token"), i);
+				break;
+			}
+		}
+		if (Table.bIsAdditive)
+		{
+			Table.CompactBias = MoveTemp(ProbeOutputs[0]);
+		}
+	}
+
+	return NewTables;
+}
+
+void FMIDIGeneratorEnv::UpdatePenaltyTables()
+{
+	PenaltyTables.SetNum(1 + Branches.Num());
+	for (int32 i = 0; i < PenaltyTables.Num(); i++)
+	{
+		FMIDIGenerationSettings Settings;
+		if (i == 0)
+		{
+			GetSettings(Settings);
+		}
+		else
+		{
+			Settings = Branches[i - 1].Settings;
+		}
+
+		if (!PenaltyTables[i].IsValid() || !(PenaltyTables[i]->Settings == Settings))
+		{
+			PenaltyTables[i] = BuildPenaltyTables(Settings);
+		}
+	}
+
+	PublishSamplingSetup();
+}
+
+void FMIDIGeneratorEnv::PublishSamplingSetup()
+{
+	FMIDISamplingSetup* NewSetup = new FMIDISamplingSetup();
+	NewSetup->RangeGroups = RangeGroups;
+	NewSetup->PenaltyTables = PenaltyTables;
+	NewSetup->BatchIndices.Add(MainVoiceBatchIndex);
+	for (const FMIDIGeneratorBranch& Branch : Branches)
+	{
+		NewSetup->BatchIndices.Add(Branch.BatchIndex);
+	}
+
+	// The gen thread only ever needs the latest one
+	delete PendingSamplingSetup.exchange(NewSetup);
+}
+
+void FMIDIGeneratorEnv::AdoptSamplingSetup()
+{
+	// A switch is published in order with the events, it must fit in the ring with the forks that follow it
+	const int32 NbFreeEvents = int32(GeneratedEvents.GetCapacity() - GeneratedEvents.Num());
+	if (PendingSamplingSetup.load() == nullptr || NbFreeEvents < 1 + Branches.Num())
+	{
+		return;
+	}
+
+	TUniquePtr<FMIDISamplingSetup> NewSetup(PendingSamplingSetup.exchange(nullptr));
+	if (!NewSetup.IsValid())
+	{
+		return;
+	}
+
+	const bool bIsSwitch = SamplingSetup.IsValid() && SamplingSetup->BatchIndices[0] != NewSetup->BatchIndices[0];
+	const bool bHaveRangeGroupsChanged = !SamplingSetup.IsValid() || SamplingSetup->RangeGroups != NewSetup->RangeGroups;
+	SamplingSetup = MoveTemp(NewSetup);
+
+	// The previous range groups are destroyed with the previous setup
+	if (bHaveRangeGroupsChanged && SamplingSetup->RangeGroups.IsValid())
+	{
+		for (FMIDIGeneratorVoice& Voice : Voices)
+		{
+			Voice.CurrentRangeGroup = SamplingSetup->RangeGroups->PitchTimeshiftRangeGroup; // we don't know what was the last token / @TODO : set according to the tokens set by the user at the start
+		}
+	}
+
+	// Played voices are generated with the current settings, branches with their own
+	BatchPenaltyTables.Init(0, Voices.Num());
+	for (int32 i = 1; i < SamplingSetup->BatchIndices.Num(); i++)
+	{
+		BatchPenaltyTables[SamplingSetup->BatchIndices[i]] = i;
+	}
+
+	if (bIsSwitch)
+	{
+		GeneratedEvents.Push(FGeneratedMidiEvent{ FMidiEvent(), 0, SamplingSetup->BatchIndices[0], GenThread->GetRewindEpoch(), FGeneratedMidiEvent::ERole::BranchSwitch });
+
+		// The other branches, and the line that was played, have to continue the new one
+		UpdateBranches(true);
+	}
+}
+
+const float* FMIDIGeneratorEnv::ApplyPenalties(int32 BatchIndex, float* Logits) const
+{
+	const FMIDIGeneratorVoice& Voice = Voices[BatchIndex];
+
+	// The firework observer applies its own penalties
+	if (bHasFireworkEffect && PlayFireworkEffect && Voice.nbEncodedTokensSinceRegen < 3)
+	{
+		return nullptr;
+	}
+
+	const FMIDIPenaltyTables& Tables = *SamplingSetup->PenaltyTables[BatchPenaltyTables[BatchIndex]];
+	const FMIDIPenaltyTable* Table = Tables.Tables.Find(Voice.CurrentRangeGroup);
+	if (Table != nullptr && Table->bIsAdditive)
+	{
+		return Table->CompactBias.GetData();
+	}
+
+	SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing2);
+	ApplyPenaltyTransforms(Logits, Voice.CurrentRangeGroup, Tables.Settings);
+	return nullptr;
+}
+
+void FMIDIGeneratorEnv::UpdateCurrentRangeGroup(int32 VoiceIndex, int32 LastDecodedToken)
 {
+	if (!SamplingSetup.IsValid() || !SamplingSetup->RangeGroups.IsValid())
+	{
+		return;
+	}
+
 	const FTokenizer& Tok = GenThread->GetTok();
+	const FMIDIRangeGroups& UsedRangeGroups = *SamplingSetup->RangeGroups;
+	RangeGroupHandle& CurrentRangeGroup = Voices[VoiceIndex].CurrentRangeGroup;
 
 	if (Tok.IsTimeShift(LastDecodedToken))
 	{
-		CurrentRangeGroup = PitchRangeGroup;
+		CurrentRangeGroup = UsedRangeGroups.PitchRangeGroup;
 		return;
 	}
 
 	int32 noteSequenceIndex = 0;
-	TArray<RangeGroupHandle> rangeGroups;
+	TArray<RangeGroupHandle, TInlineAllocator<3>> rangeGroups;
 	//if (nbEncodedTokensSinceRegen < 3)
 	//{
 	//	//hasRegenCounter++;
@@ -100,11 +550,11 @@ void FMIDIGeneratorEnv::UpdateCurrentRangeGroup(int32 LastDecodedToken)
 	//	//hasRegen = false;
 	//}
 	//else
-		rangeGroups.Add(PitchTimeshiftRangeGroup);
+		rangeGroups.Add(UsedRangeGroups.PitchTimeshiftRangeGroup);
 	if (Tok.UseVelocities())
-		rangeGroups.Add(VelocityRangeGroup);
+		rangeGroups.Add(UsedRangeGroups.VelocityRangeGroup);
 	if (Tok.UseDuration())
-			rangeGroups.Add(DurationRangeGroup);
+			rangeGroups.Add(UsedRangeGroups.DurationRangeGroup);
 	//if (FString("TSD") == Tok.GetTokenizationType())
 	//	rangeGroups.Add(TimeShiftRangeGroup);
 
@@ -151,80 +601,63 @@ TSharedPtr<FMidiFileData> BuildMidiWithOneTimeSigature(int32 Tempo, int32 Numera
 
 void FMIDIGeneratorEnv::AddFireworkEffect()
 {
+	bHasFireworkEffect = true;
+
 	GenThread->AddOnInit([this]()
 	{
-		class ScalePenalty : public AutoRegressivePipelineObserver
+		// The other penalties are applied by the search strategy, see ApplyPenalties()
+		class FireworkPenalty : public AutoRegressivePipelineObserver
 		{
 		public:
 			FMIDIGeneratorEnv& Env;
-			ScalePenalty(FMIDIGeneratorEnv& InEnv) : Env(InEnv) {}
+			// OnLogitsGenerated is called once per batch, in batch order
+			int32 BatchIndex = 0;
+			FireworkPenalty(FMIDIGeneratorEnv& InEnv) : Env(InEnv) {}
+
+			virtual void OnGenerationStarted() override
+			{
+				BatchIndex = 0;
+			}
 
 			virtual void OnLogitsGenerated(const LogitsView& logitsView) override
 			{
-				MidiTokenizerHandle Tok = Env.GenThread->GetTok().GetTokenizer();
+				const int32 VoiceIndex = BatchIndex % Env.Voices.Num();
+				const FMIDIGeneratorVoice& Voice = Env.Voices[VoiceIndex];
+				BatchIndex++;
 
-				logitsView.logits[0] = -10000000;
-				rangeGroupUpdateCache(Env.CurrentRangeGroup);
+				if (!Env.PlayFireworkEffect || Voice.nbEncodedTokensSinceRegen >= 3)
+				{
+					return;
+				}
 
-				//if (Env.Scale != nullptr && Env.ScaleSize != 0)
-				//{
-				//	//musicalScalePenaltyTransform(args.logitsTensor, CurrentRangeGroup, Scales::Ionian::CMajor::get(), Scales::Ionian::CMajor::size(), 1.05, Tok);
-				//	musicalScalePenaltyTransform(logitsView.logits, Env.CurrentRangeGroup, Env.Scale, Env.ScaleSize, 1.05, Tok);
-				//}
+				MidiTokenizerHandle Tok = Env.GenThread->GetTok().GetTokenizer();
 
+				// Branches are generated with their own settings
+				const FMIDIGenerationSettings& Settings = Env.SamplingSetup->PenaltyTables[Env.BatchPenaltyTables[VoiceIndex]]->Settings;
 
+				const int32_t* Scale = nullptr;
+				int32_t ScaleSize = 0;
+				if (Settings.bUseScale)
 				{
-					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing2);
-					//if (hasRegen)
-					//{
-					//	int32 scale[] = {0};
-					//	musicalScalePenaltyTransform(args.logitsTensor, CurrentRangeGroup, scale, 1, 1.05, Tok);
-					//}
-					//else
-					if (Env.Scale != nullptr && Env.ScaleSize != 0)
-					{
-						//musicalScalePenaltyTransform(args.logitsTensor, CurrentRangeGroup, Scales::Ionian::CMajor::get(), Scales::Ionian::CMajor::size(), 1.05, Tok);
-						musicalScalePenaltyTransform(logitsView.logits, Env.CurrentRangeGroup, Env.Scale, Env.ScaleSize, 1.05, Tok);
-					}
+					FMIDIGeneratorEnv::GetScaleNotes(Settings.Scale, Scale, ScaleSize);
 				}
+
 				{
-					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing3);
-					if (Env.PlayFireworkEffect && Env.nbEncodedTokensSinceRegen < 3)
-					{
-						//pitchRangePenaltyTransform(args.logitsTensor, CurrentRangeGroup, 70, 90, 0.7, Tok);
-						pitchRangePenaltyTransform(logitsView.logits, Env.CurrentRangeGroup, 70, 90, 15.0, Tok);
-					}
-					else
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing2);
+					if (Scale != nullptr && ScaleSize != 0)
 					{
-						pitchRangePenaltyTransform(logitsView.logits, Env.CurrentRangeGroup, Env.minPitch, Env.maxPitch, 8.0, Tok);
-						//pitchRangePenaltyTransform(args.logitsTensor, CurrentRangeGroup, 40, 60, 0.7, Tok);
+						musicalScalePenaltyTransform(logitsView.logits, Voice.CurrentRangeGroup, Scale, ScaleSize, 1.05, Tok);
 					}
-					//pitchRangePenaltyTransform(args.logitsTensor, CurrentRangeGroup, 40, 80, 0.05, Tok);
 				}
-
 				{
-					//SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing3);
-					timeShiftRangePenaltyTransform(logitsView.logits, Env.CurrentRangeGroup, Env.minTimeShift, Env.maxTimeShift, 1.05, Tok);
-
-					//if (nbEncodedTokensSinceRegen < 20)
-					//{
-					//	timeShiftRangePenaltyTransform(args.logitsTensor, CurrentRangeGroup, -1.0, -1, 1.05, Tok);
-					//}
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing3);
+					pitchRangePenaltyTransform(logitsView.logits, Voice.CurrentRangeGroup, 70, 90, 15.0, Tok);
 				}
-
-				//{
-				//	SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing1);
-				//	SpecialPenaltyTransformArgs sArgs;
-				//	sArgs.pitchWindowSize = 20;
-				//	sArgs.pitchMaxAdditivePenalty = 0.05;
-				//	specialPenaltyTransform(args.logitsTensor, CurrentRangeGroup, History, &sArgs);
-				//}
-
+				timeShiftRangePenaltyTransform(logitsView.logits, Voice.CurrentRangeGroup, Settings.MinTimeShift, Settings.MaxTimeShift, 1.05, Tok);
 			}
 		};
 
-		// TODO : delete / free up memory
-		GenThread->GetPipeline()->addObserver(new ScalePenalty(*this));
+		GenThread->AddObserver(MakeShared<FireworkPenalty>(*this));
 	});
 }
 
@@ -232,7 +665,11 @@ void FMIDIGeneratorEnv::StartGeneration()
 {
 	//GenThread->Start();
 
-	if (!GenThread->HasStarted())
+	PipelineLoadingMutex.Lock();
+	const bool bIsAlreadyQueued = bIsStartQueued;
+	PipelineLoadingMutex.Unlock();
+
+	if (!GenThread->HasStarted() && !bIsAlreadyQueued)
 	{
 		int32 CurrentTempo = 120;
 		int32 CurrentTimeSigNum = 4;
@@ -252,21 +689,51 @@ void FMIDIGeneratorEnv::StartGeneration()
 		// it's private, can't access it and can't modify or refresh it
 		// so instead, just add an event that's really far away
 		track.AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
-		MidiFileData->Tracks.Add(MoveTemp(track));
+		MidiFileData->Tracks.Add(track);
+
+		// The first voice keeps Tracks[0] and Tracks[1], the other ones get a track each
+		// Branches come after the voices and aren't played until switched to
+		Voices.SetNum(GenThread->GetNbBatches());
+		Voices[0].bIsDoubled = true;
+		for (int32 VoiceIndex = 1; VoiceIndex < NbVoices; VoiceIndex++)
+		{
+			Voices[VoiceIndex].NoteTrackIndex = MidiFileData->Tracks.Add(track);
+			Voices[VoiceIndex].BeatTrackIndex = Voices[VoiceIndex].NoteTrackIndex;
+		}
+		for (int32 BranchIndex = 0; BranchIndex < Branches.Num(); BranchIndex++)
+		{
+			FMIDIGeneratorVoice& BranchVoice = Voices[NbVoices + BranchIndex];
+			BranchVoice.NoteTrackIndex = INDEX_NONE;
+			BranchVoice.BeatTrackIndex = INDEX_NONE;
+		}
+		// Allocated here rather than by the audio thread, every voice can be switched to or from
+		if (!Branches.IsEmpty())
+		{
+			for (FMIDIGeneratorVoice& Voice : Voices)
+			{
+				Voice.UpcomingEvents.Reserve(NbMaxUpcomingEvents);
+			}
+		}
+		SettingsMutex.Lock();
+		for (int32 BranchIndex = 0; BranchIndex < Branches.Num(); BranchIndex++)
+		{
+			Branches[BranchIndex].BatchIndex = NbVoices + BranchIndex;
+		}
+		MainVoiceBatchIndex = 0;
+		UpdatePenaltyTables();
+		SettingsMutex.Unlock();
+		PlayedMainBatchIndex = 0;
+		LastBranchForkTick = INT_MIN;
+		TrackStagers.SetNum(MidiFileData->Tracks.Num());
 
 		MidiDataProxy = MakeShared<FMidiFileProxy, ESPMode::ThreadSafe>(MidiFileData);
 
-		GenThread->SetOnGenerated([this](int32 NewToken)
+		GenThread->SetOnGenerated([this](int32 BatchIndex, int32 NewToken)
 			{
-				nbEncodedTokensSinceRegen++;
-				bShouldUpdateTokens = true;
-				NewEncodedTokens.Add(NewToken);
-
-				const int32_t* outDecodedTokensBegin;
-				const int32_t* outDecodedTokensEnd;
-				tokenizer_decodeTokenFast(GenThread->GetTok().GetTokenizer(), NewToken, &outDecodedTokensBegin, &outDecodedTokensEnd);
+				Voices[BatchIndex].nbEncodedTokensSinceRegen++;
 
-				if (outDecodedTokensEnd - outDecodedTokensBegin == 0)
+				const TArrayView<const int32> DecodedTokens = GenThread->GetTok().DecodeToken(NewToken);
+				if (DecodedTokens.IsEmpty())
 				{
 					return;
 				}
@@ -279,43 +746,71 @@ void FMIDIGeneratorEnv::StartGeneration()
 				//}
 
 				//UE_LOG(LogTemp, Warning, TEXT("Pitch : %d"), NewToken);
-				int32 LastToken = *(outDecodedTokensEnd - 1);
+				int32 LastToken = DecodedTokens.Last();
 
-				UpdateCurrentRangeGroup(LastToken);
+				UpdateCurrentRangeGroup(BatchIndex, LastToken);
 			});
 
 		//AddFireworkEffect();
 
+		// Broadcast by the gen thread once the tokenizer is loaded, even if it's set after Start()
 		GenThread->AddOnInit([this]()
 		{
 			SetFilter();
+			AdoptSamplingSetup();
+			if (SamplingSetup.IsValid() && SamplingSetup->RangeGroups.IsValid())
+			{
+				SetSearchStrategy();
+			}
+			else
+			{
+				UE_LOG(LogTemp, Error, TEXT("Couldn't build the range groups, the generation won't start"));
+			}
 		});
 
 		GenThread->OnCacheRemoved.AddLambda([this](int32 libTick)
 			{
-				GenerationHistory* History = GenThread->GetPipeline()->getHistory(GenThread->GetBatch());
-				const struct Note* OutNotes;
-				size_t OutLength;
-				generationHistory_getNotes(History, &OutNotes, &OutLength);
-
-				nextNoteIndexToProcess = FMath::Min(nextNoteIndexToProcess, int32(OutLength));
-
-				TokenHistoryHandle decodedTokenHistory = getDecodedTokensHistory(History);
-				const int32* decodedTokens;
-				int32 decodedTokensSize;
-				tokenHistory_getTokens(decodedTokenHistory, &decodedTokens, &decodedTokensSize);
-				UpdateCurrentRangeGroup(decodedTokens[decodedTokensSize - 1]);
+				for (int32 VoiceIndex = 0; VoiceIndex < Voices.Num(); VoiceIndex++)
+				{
+					SyncVoiceWithHistory(VoiceIndex);
+				}
 			});
 
-		// Set default tokens
-		GenThread->GetEncodedTokens(NewEncodedTokens);
+		GenThread->SetOnBeforeToken([this]()
+			{
+				AdoptSamplingSetup();
+				if (!Branches.IsEmpty())
+				{
+					UpdateBranches(false);
+				}
+			});
 
-		GenThread->Start();
+		GenThread->SetNoteDecoder([this](int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch)
+			{
+				return BuildMidiEvents(BatchIndex, Notes, NbNotes, Epoch);
+			});
+
+		// The MIDI data is ready to be played, but the gen thread needs the pipeline
+		PipelineLoadingMutex.Lock();
+		if (bIsPipelineLoading)
+		{
+			bIsStartQueued = true;
+		}
+		else
+		{
+			GenThread->Start();
+		}
+		PipelineLoadingMutex.Unlock();
 	}
 }
 
 void FMIDIGeneratorEnv::StopGeneration()
 {
+	// A pipeline still loading must not start the generation once stopped
+	PipelineLoadingMutex.Lock();
+	bIsStartQueued = false;
+	PipelineLoadingMutex.Unlock();
+
 	GenThread->Stop();
 }
 
@@ -330,286 +825,429 @@ void FMIDIGeneratorEnv::SetFilter()
 		return;
 	}
 
-	BaseRangeGroup = createRangeGroup();
-	tokenizer_addTokensStartingByPosition(tok, BaseRangeGroup);
-	tokenizer_addTokensStartingByBarNone(tok, BaseRangeGroup);
-	tokenizer_addTokensStartingByTimeShift(tok, BaseRangeGroup);
-	//rangeGroupUpdateCache(BaseRangeGroup);
-
-	PitchTimeshiftRangeGroup = cloneRangeGroup(BaseRangeGroup);
-	tokenizer_addTokensStartingByPitch(tok, PitchTimeshiftRangeGroup);
-	rangeGroupUpdateCache(PitchTimeshiftRangeGroup);
-
-	PitchRangeGroup = createRangeGroup();
-	tokenizer_addTokensStartingByPitch(tok, PitchRangeGroup);
-	rangeGroupUpdateCache(PitchRangeGroup);
-
-	VelocityRangeGroup = createRangeGroup();
-	tokenizer_addTokensStartingByVelocity(tok, VelocityRangeGroup);
-	rangeGroupUpdateCache(VelocityRangeGroup);
-
-	DurationRangeGroup = createRangeGroup();
-	tokenizer_addTokensStartingByDuration(tok, DurationRangeGroup);
-	rangeGroupUpdateCache(DurationRangeGroup);
+	TSharedPtr<FMIDIRangeGroups, ESPMode::ThreadSafe> NewRangeGroups = MakeShared<FMIDIRangeGroups, ESPMode::ThreadSafe>();
+
+	NewRangeGroups->BaseRangeGroup = createRangeGroup();
+	tokenizer_addTokensStartingByPosition(tok, NewRangeGroups->BaseRangeGroup);
+	tokenizer_addTokensStartingByBarNone(tok, NewRangeGroups->BaseRangeGroup);
+	tokenizer_addTokensStartingByTimeShift(tok, NewRangeGroups->BaseRangeGroup);
+	//rangeGroupUpdateCache(NewRangeGroups->BaseRangeGroup);
+
+	NewRangeGroups->PitchTimeshiftRangeGroup = cloneRangeGroup(NewRangeGroups->BaseRangeGroup);
+	tokenizer_addTokensStartingByPitch(tok, NewRangeGroups->PitchTimeshiftRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->PitchTimeshiftRangeGroup);
+
+	NewRangeGroups->PitchRangeGroup = createRangeGroup();
+	tokenizer_addTokensStartingByPitch(tok, NewRangeGroups->PitchRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->PitchRangeGroup);
+
+	NewRangeGroups->VelocityRangeGroup = createRangeGroup();
+	tokenizer_addTokensStartingByVelocity(tok, NewRangeGroups->VelocityRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->VelocityRangeGroup);
+
+	NewRangeGroups->DurationRangeGroup = createRangeGroup();
+	tokenizer_addTokensStartingByDuration(tok, NewRangeGroups->DurationRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->DurationRangeGroup);
+
+	NewRangeGroups->TimeShiftRangeGroup = createRangeGroup();
+	tokenizer_addTokensStartingByTimeShift(tok, NewRangeGroups->TimeShiftRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->TimeShiftRangeGroup);
+
+	NewRangeGroups->AllRangeGroup = cloneRangeGroup(NewRangeGroups->BaseRangeGroup);
+	tokenizer_addTokensStartingByPitch(tok, NewRangeGroups->AllRangeGroup);
+	tokenizer_addTokensStartingByVelocity(tok, NewRangeGroups->AllRangeGroup);
+	tokenizer_addTokensStartingByDuration(tok, NewRangeGroups->AllRangeGroup);
+	tokenizer_addTokensStartingByTimeShift(tok, NewRangeGroups->AllRangeGroup);
+	tokenizer_addTokensStartingByPosition(tok, NewRangeGroups->AllRangeGroup);
+	tokenizer_addTokensStartingByBarNone(tok, NewRangeGroups->AllRangeGroup);
+	rangeGroupUpdateCache(NewRangeGroups->AllRangeGroup);
+
+	// The library range groups are only kept for the penalty transforms
+	auto Union = [&tok2](std::initializer_list<ETokenClass> Classes)
+	{
+		FRangeGroupMask Mask;
+		for (ETokenClass Class : Classes)
+		{
+			Mask = FRangeGroupMask::Or(Mask, tok2.GetClassMask(Class));
+		}
+		return Mask;
+	};
+	const FRangeGroupMask BaseMask = Union({ ETokenClass::Position, ETokenClass::BarNone, ETokenClass::TimeShift });
 
-	TimeShiftRangeGroup = createRangeGroup();
-	tokenizer_addTokensStartingByTimeShift(tok, TimeShiftRangeGroup);
-	rangeGroupUpdateCache(TimeShiftRangeGroup);
+	NewRangeGroups->Masks.Add(NewRangeGroups->PitchTimeshiftRangeGroup, FRangeGroupMask::Or(BaseMask, tok2.GetClassMask(ETokenClass::Pitch)));
+	NewRangeGroups->Masks.Add(NewRangeGroups->PitchRangeGroup, tok2.GetClassMask(ETokenClass::Pitch));
+	NewRangeGroups->Masks.Add(NewRangeGroups->VelocityRangeGroup, tok2.GetClassMask(ETokenClass::Velocity));
+	NewRangeGroups->Masks.Add(NewRangeGroups->DurationRangeGroup, tok2.GetClassMask(ETokenClass::Duration));
+	NewRangeGroups->Masks.Add(NewRangeGroups->TimeShiftRangeGroup, tok2.GetClassMask(ETokenClass::TimeShift));
+	NewRangeGroups->Masks.Add(NewRangeGroups->AllRangeGroup, FRangeGroupMask::Or(BaseMask, Union({ ETokenClass::Pitch, ETokenClass::Velocity, ETokenClass::Duration })));
 
-	AllRangeGroup = cloneRangeGroup(BaseRangeGroup);
-	tokenizer_addTokensStartingByPitch(tok, AllRangeGroup);
-	tokenizer_addTokensStartingByVelocity(tok, AllRangeGroup);
-	tokenizer_addTokensStartingByDuration(tok, AllRangeGroup);
-	tokenizer_addTokensStartingByTimeShift(tok, AllRangeGroup);
-	tokenizer_addTokensStartingByPosition(tok, AllRangeGroup);
-	tokenizer_addTokensStartingByBarNone(tok, AllRangeGroup);
-	rangeGroupUpdateCache(AllRangeGroup);
+#if DO_ENSURE
+	for (const TPair<RangeGroupHandle, FRangeGroupMask>& RangeGroupMask : NewRangeGroups->Masks)
+	{
+		const int32 NbRangeGroupTokens = FRangeGroupMask::FromRangeGroup(RangeGroupMask.Key, RangeGroupMask.Value.GetVocabSize()).GetNbTokens();
+		ensureMsgf(RangeGroupMask.Value.GetNbTokens() == NbRangeGroupTokens,
+			TEXT("The tokenizer class masks don't match the library range group (%d tokens instead of %d)"),
+			RangeGroupMask.Value.GetNbTokens(), NbRangeGroupTokens);
+	}
+#endif
 
-	//CurrentRangeGroup = PitchTimeshiftRangeGroup;
-	CurrentRangeGroup = PitchTimeshiftRangeGroup; // we don't know what was the last token / @TODO : set according to the tokens set by the user at the start
+	// Built off to the side, the gen thread keeps using the previous ones until it takes the new setup
+	// Tables are keyed by range group, all of them are built again
+	SettingsMutex.Lock();
+	RangeGroups = NewRangeGroups;
+	PenaltyTables.Reset();
+	UpdatePenaltyTables();
+	SettingsMutex.Unlock();
+}
 
+void FMIDIGeneratorEnv::SetSearchStrategy()
+{
 	GenThread->SetSearchStrategy([this](const SearchArgs& args)
 		{
+			FScopedLatency ScopedLatency(ELatencyStage::SearchStrategy);
+
 			//MidiTokenizerHandle tok = GenThread->GetTok();
 
 			//CurrentRangeGroup = AllRangeGroup;
 
-			const Range* ranges;
-			size_t nbRanges;
-			rangeGroupGetRanges(CurrentRangeGroup, &ranges, &nbRanges);
-
 			//temperatureTransform(&args, ranges, nbRanges);
 			//repetitionPenalty(&args, ranges, nbRanges);
 			//args.logitsTensor[0] = -10000000;
 
-			//float temperature = 1.1;
-			//temperatureTransform(args.logitsTensor, ranges, nbRanges, temperature);
-
-			float repetitionPenalty = 1.1;
-			IAutoRegressivePipeline* Pipeline = GenThread->GetPipeline();
-			GenerationHistory* History = Pipeline->getHistory(GenThread->GetBatch());
-			//repetitionPenaltyTransform(args.logitsTensor, ranges, nbRanges, repetitionPenalty, History, 100);
-
-			rangeGroupUpdateCache(CurrentRangeGroup);
-
-			MidiTokenizerHandle Tok = GenThread->GetTok().GetTokenizer();
-
-
-			FMIDIGeneratorEnv& Env = *this;
-			LogitsView logitsView;
-			int b = 0; // only first batch
-			float* batchLastLogits = args.logitsTensor + (b * args.nbSequences + (args.nbSequences - 1)) * args.vocabSize;
-			logitsView.logits = batchLastLogits;
-			logitsView.vocabSize = args.vocabSize;
+			//float temperature = 1.1;
+			//temperatureTransform(args.logitsTensor, ranges, nbRanges, temperature);
 
+			//float repetitionPenalty = 1.1;
+			//repetitionPenaltyTransform(args.logitsTensor, ranges, nbRanges, repetitionPenalty, History, 100);
 
+			check(args.nbBatches == Voices.Num());
+			for (int b = 0; b < args.nbBatches; b++)
+			{
+				RangeGroupHandle CurrentRangeGroup = Voices[b].CurrentRangeGroup;
 
+				LogitsView logitsView;
+				float* batchLastLogits = args.logitsTensor + (b * args.nbSequences + (args.nbSequences - 1)) * args.vocabSize;
+				logitsView.logits = batchLastLogits;
+				logitsView.vocabSize = args.vocabSize;
 
+				int nbTopTokenSize = 40;
+				float topP = 0.5;
 
+				const TArray<FLogitsKernel::FSpan>& Spans = GetRangeGroupSpans(CurrentRangeGroup);
 
+				if (SamplingMode == ESamplingMode::Fused)
+				{
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing7);
 
+					// The fused kernel adds the bias while gathering the logits
+					const float* CompactBias = ApplyPenalties(b, logitsView.logits);
+					args.outNextTokens[b] = LogitsKernel.Sample(logitsView.logits, Spans, CompactBias, nbTopTokenSize, topP, FMath::FRand());
+					continue;
+				}
 
-			check(args.nbBatches == 1);
-			int nbTopTokenSize = 40;
-			size_t CurrentRangeGroupSize = rangeGroupSize(CurrentRangeGroup);
-			TArray<int32> LogitIndices;
-			LogitIndices.SetNumUninitialized(CurrentRangeGroupSize);
-			int32* LogitIndicesData = LogitIndices.GetData();
-			{
-				SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing4);
-				rangeGroupWrite(CurrentRangeGroup, LogitIndicesData);
-			}
-			check(CurrentRangeGroupSize >= nbTopTokenSize);
-			{
-				SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing5);
-				sortLogits(logitsView.logits, LogitIndicesData, LogitIndicesData + CurrentRangeGroupSize, nbTopTokenSize);
-			}
+				// The library functions run on the compact logits of the range group, with indices in it
+				{
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing4);
+					const float* CompactBias = ApplyPenalties(b, logitsView.logits);
+					FLogitsKernel::Gather(logitsView.logits, Spans, CompactBias, SparseLogits);
+					SparseLogitIndices.SetNumUninitialized(SparseLogits.Num(), EAllowShrinking::No);
+					for (int32 i = 0; i < SparseLogitIndices.Num(); i++)
+					{
+						SparseLogitIndices[i] = i;
+					}
+				}
+				const int32 CurrentRangeGroupSize = SparseLogits.Num();
+				float* SparseLogitsData = SparseLogits.GetData();
+				int32* LogitIndicesData = SparseLogitIndices.GetData();
+				check(CurrentRangeGroupSize >= nbTopTokenSize);
+				{
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing5);
+					sortLogits(SparseLogitsData, LogitIndicesData, LogitIndicesData + CurrentRangeGroupSize, nbTopTokenSize);
+				}
 
-			{
-				SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing6);
-				stableSoftmax(logitsView.logits, LogitIndicesData, LogitIndicesData + nbTopTokenSize);
-			}
+				{
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing6);
+					stableSoftmax(SparseLogitsData, LogitIndicesData, LogitIndicesData + nbTopTokenSize);
+				}
 
-			{
-				SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing7);
-				int outToken = topPSampling(logitsView.logits, LogitIndicesData, LogitIndicesData + nbTopTokenSize, 0.5);
-				args.outNextTokens[0] = outToken;
+				{
+					SCOPE_CYCLE_COUNTER(STAT_GenThread_LogitProcessing7);
+					int outCompactIndex = topPSampling(SparseLogitsData, LogitIndicesData, LogitIndicesData + nbTopTokenSize, topP);
+					args.outNextTokens[b] = FLogitsKernel::CompactIndexToToken(Spans, outCompactIndex);
+				}
 			}
 		});
 }
-int prevCounter = 0;
-void FMIDIGeneratorEnv::DecodeTokens()
+int32 FMIDIGeneratorEnv::BuildMidiEvents(int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch)
 {
-	struct Args
-	{
-		FMIDIGeneratorEnv* self;
+	SCOPE_CYCLE_COUNTER(STAT_GenThread_BuildMidiEvents);
 
-		int32 LastTick = 0;
+	auto pushEvent = [this, BatchIndex, Epoch](FGeneratedMidiEvent::ERole Role, int32 LibTick, int32 Tick, const FMidiMsg& Msg)
+	{
+		GeneratedEvents.Push(FGeneratedMidiEvent{ FMidiEvent(Tick, Msg), LibTick, BatchIndex, Epoch, Role });
+	};
+	auto getNbFreeEvents = [this]()
+	{
+		return int32(GeneratedEvents.GetCapacity() - GeneratedEvents.Num());
 	};
 
-	Args args{ this };
-	 
-	auto onNote = [](void* data, const Note& newNote)
+	// A note is only decoded once all its events fit in the ring, otherwise it's decoded on the next call
+	int32 NbDecodedNotes = 0;
+	for (; NbDecodedNotes < NbNotes && getNbFreeEvents() >= 4; NbDecodedNotes++)
 	{
-		Args& args = *(Args*)(data);
+		const Note& NewNote = Notes[NbDecodedNotes];
 
-		int32 NoteNumber = newNote.pitch;
-		int32 Velocity = newNote.velocity;
+		int32 NoteNumber = NewNote.pitch;
+		int32 Velocity = NewNote.velocity;
 		if (NoteNumber < 60)
 		{
 			Velocity += 60 - NoteNumber;
 		}
 
-		//if (NoteNumber == 70)
-		//{
-		//	UE_LOG(LogTemp, Warning, TEXT("=== Adding Event 70 ==="));
-		//}
+		int32 Tick = FMath::RoundToInt32(float(GenLibTickToUETick(NewNote.tick)));
+		int32 OffTick = FMath::RoundToInt32(float(GenLibTickToUETick(NewNote.tick + NewNote.duration * 4)));
 
-		int32 Track = 0;
+		pushEvent(FGeneratedMidiEvent::ERole::Note, NewNote.tick, Tick, FMidiMsg::CreateNoteOn(0, NoteNumber, Velocity));
+		pushEvent(FGeneratedMidiEvent::ERole::Note, NewNote.tick, OffTick, FMidiMsg::CreateNoteOff(0, NoteNumber));
 
-		//int32 CurrentTick = 0;// args.self->Outputs.MidiClock->GetCurrentHiResTick();
-		int32 CurrentTick = args.self->CurrentTick;// args.self->Outputs.MidiClock->GetCurrentHiResTick();
-
-		int32 Tick = FMath::RoundToInt32(float(args.self->GenLibTickToUETick(newNote.tick)));
-		int32 OffTick = FMath::RoundToInt32(float(args.self->GenLibTickToUETick(newNote.tick + newNote.duration*4)));
-
-		//if (Tick < CurrentTick)
-		//{
-		//	UE_LOG(LogTemp, Warning, TEXT("Tick < CurrentTick: %d < %d"), CurrentTick, Tick);
-		//	args.self->AddedTicks += CurrentTick - Tick;
-		//	Tick = CurrentTick;
-		//}
+		// Drawn here for every voice, only played by the doubled one
+		if (FMath::FRand() < 0.5)
+		{
+			pushEvent(FGeneratedMidiEvent::ERole::DoubledNote, NewNote.tick, Tick, FMidiMsg::CreateNoteOn(1, NoteNumber, Velocity));
+			pushEvent(FGeneratedMidiEvent::ERole::DoubledNote, NewNote.tick, OffTick, FMidiMsg::CreateNoteOff(1, NoteNumber));
+		}
+	}
 
-		//if (args.self->regenTick < 3)
-		//{
-		//	Tick = args.self->CacheRemoveTick;
-		//}
+	if (!GenerateBeats)
+	{
+		return NbDecodedNotes;
+	}
 
-		//if (NoteNumber != 70)
-		//{
-		//	return;
-		//}
+	// Branches keep their beat generator up to date, in case they get switched to
+	FMIDIGeneratorVoice& Voice = Voices[BatchIndex];
+	BeatGeneratorHandle BeatGenerator = GenThread->GetBeatGenerator(BatchIndex);
 
-		//UE_LOG(LogTemp, Warning, TEXT("=== Added Note / Current: %d / New Note: %d"), CurrentTick, Tick);
+	FScopedLatency ScopedLatency(ELatencyStage::BeatGeneration);
+	GenThread->BeatGeneratorMutex.Lock();
+	if (NbDecodedNotes > 0)
+	{
+		beatGenerator_refresh(BeatGenerator, Notes, Notes + NbDecodedNotes);
+	}
 
-		args.LastTick = Tick;
+	const BeatNote* outBeatNotes;
+	int32_t outBeatsLength;
+	beatGenerator_getNotes(BeatGenerator, &outBeatNotes, &outBeatsLength);
+	for (; Voice.nextBeatNoteIndexToProcess < outBeatsLength && getNbFreeEvents() >= 2; Voice.nextBeatNoteIndexToProcess++)
+	{
+		// @TODO : switch on type
+		//beatNote->type;
 
-		//bool d0 = FMath::FRand() < 0.8;
-		//if (d0)
-		{
-			int32 Channel = 0;
-			FMidiMsg Msg{ FMidiMsg::CreateNoteOn(Channel, NoteNumber, Velocity) };
-			args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(Tick, Msg));
+		auto [Tick, Duration, Pitch, Velocity] = outBeatNotes[Voice.nextBeatNoteIndexToProcess].note;
+		int32 Channel = 9;
+		Velocity = 40;
 
-			FMidiMsg OffMsg{ FMidiMsg::CreateNoteOff(Channel, NoteNumber) };
-			args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(OffTick, OffMsg));
-			args.self->MidiFileData->Tracks[0].Sort();
-		}
+		int32 OnTick = FMath::RoundToInt32(float(GenLibTickToUETick(Tick)));
+		int32 OffTick = FMath::RoundToInt32(float(GenLibTickToUETick(Tick + Duration * 8)));
 
-		//if (!d0 || FMath::FRand() < 0.5)
-		if (FMath::FRand() < 0.5)
-		{
-			int32 Channel = 1;
-			FMidiMsg Msg{ FMidiMsg::CreateNoteOn(Channel, NoteNumber, Velocity) };
-			args.self->MidiFileData->Tracks[1].AddEvent(FMidiEvent(Tick, Msg));
+		pushEvent(FGeneratedMidiEvent::ERole::Beat, Tick, OnTick, FMidiMsg::CreateNoteOn(Channel, Pitch, Velocity));
+		pushEvent(FGeneratedMidiEvent::ERole::Beat, Tick, OffTick, FMidiMsg::CreateNoteOff(Channel, Pitch));
+	}
+	GenThread->BeatGeneratorMutex.Unlock();
 
-			FMidiMsg OffMsg{ FMidiMsg::CreateNoteOff(Channel, NoteNumber) };
-			args.self->MidiFileData->Tracks[1].AddEvent(FMidiEvent(OffTick, OffMsg));
-			args.self->MidiFileData->Tracks[1].Sort();
-		}
+	return NbDecodedNotes;
+}
 
+void FMIDIGeneratorEnv::SyncVoiceWithHistory(int32 BatchIndex)
+{
+	GenerationHistory* History = GenThread->GetPipeline()->getHistory(GenThread->GetBatch(BatchIndex));
 
-		//if (args.self->MidiFileData->Tracks[0].GetUnsortedEvents().IsEmpty() or Tick >= args.self->MidiFileData->Tracks[0].GetEvents().Last().GetTick())
-		//{
-		//	args.LastTick = Tick;
+	TokenHistoryHandle decodedTokenHistory = getDecodedTokensHistory(History);
+	const int32* decodedTokens;
+	int32 decodedTokensSize;
+	tokenHistory_getTokens(decodedTokenHistory, &decodedTokens, &decodedTokensSize);
+	if (decodedTokensSize > 0)
+	{
+		UpdateCurrentRangeGroup(BatchIndex, decodedTokens[decodedTokensSize - 1]);
+	}
 
-		//	FMidiMsg Msg{ FMidiMsg::CreateNoteOn(Channel, NoteNumber, Velocity) }; 
-		//	args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(Tick, Msg));
+	// Beats after the rewind have been removed, they are built again with the new notes
+	const BeatNote* outBeatNotes;
+	int32_t outBeatsLength;
+	GenThread->BeatGeneratorMutex.Lock();
+	beatGenerator_getNotes(GenThread->GetBeatGenerator(BatchIndex), &outBeatNotes, &outBeatsLength);
+	GenThread->BeatGeneratorMutex.Unlock();
+	Voices[BatchIndex].nextBeatNoteIndexToProcess = FMath::Min(Voices[BatchIndex].nextBeatNoteIndexToProcess, int32(outBeatsLength));
+}
 
-		//	FMidiMsg OffMsg{ FMidiMsg::CreateNoteOff(Channel, NoteNumber) };
-		//	args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(OffTick, OffMsg));
-		//	args.self->MidiFileData->Tracks[0].Sort();
-		//}
-		//else // if (NoteNumber == 70)// SORTS : @TODO : opti sort
-		//{
-		//	args.LastTick = Tick;
+void FMIDIGeneratorEnv::UpdateBranches(bool bIsForced)
+{
+	// The forks are published in order with the events, they must all fit in the ring
+	const int32 NbFreeEvents = int32(GeneratedEvents.GetCapacity() - GeneratedEvents.Num());
+	if (NbFreeEvents < Branches.Num())
+	{
+		return;
+	}
 
-		//	FMidiMsg Msg{ FMidiMsg::CreateNoteOn(Channel, NoteNumber, Velocity) };
-		//	args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(Tick, Msg));
+	const int32 PlayedTick = GenThread->CurrentTick.load();
+	if (!bIsForced && int64(PlayedTick) < int64(LastBranchForkTick) + NbTicksPerBranchFork)
+	{
+		return;
+	}
+	LastBranchForkTick = PlayedTick;
 
-		//	FMidiMsg OffMsg{ FMidiMsg::CreateNoteOff(Channel, NoteNumber) };
-		//	args.self->MidiFileData->Tracks[0].AddEvent(FMidiEvent(OffTick, OffMsg));
-		//	args.self->MidiFileData->Tracks[0].Sort();
-		//}
+	const TArray<int32>& BatchIndices = SamplingSetup->BatchIndices;
+	for (int32 i = 1; i < BatchIndices.Num(); i++)
+	{
+		int32 RewindTick = 0;
+		if (GenThread->ForkBatch(BatchIndices[i], BatchIndices[0], PlayedTick, RewindTick))
+		{
+			SyncVoiceWithHistory(BatchIndices[i]);
+			GeneratedEvents.Push(FGeneratedMidiEvent{ FMidiEvent(), RewindTick, BatchIndices[i], GenThread->GetRewindEpoch(), FGeneratedMidiEvent::ERole::BranchFork });
+		}
+	}
+}
 
-	};
+int32 FMIDIGeneratorEnv::GetEventTrackIndex(const FMIDIGeneratorVoice& Voice, FGeneratedMidiEvent::ERole Role)
+{
+	switch (Role)
+	{
+		case FGeneratedMidiEvent::ERole::Note:
+			return Voice.NoteTrackIndex;
+		case FGeneratedMidiEvent::ERole::DoubledNote:
+			return Voice.bIsDoubled ? 1 : INDEX_NONE;
+		case FGeneratedMidiEvent::ERole::Beat:
+			return Voice.BeatTrackIndex;
+		default:
+			break;
+	}
+	return INDEX_NONE;
+}
 
-	//const double StartTime = FPlatformTime::Seconds();
+void FMIDIGeneratorEnv::SwitchPlayedBatch(int32 BatchIndex)
+{
+	FMIDIGeneratorVoice& PlayedVoice = Voices[PlayedMainBatchIndex];
+	FMIDIGeneratorVoice& BranchVoice = Voices[BatchIndex];
+	PlayedMainBatchIndex = BatchIndex;
+
+	// The branch takes over the tracks, the played voice keeps being generated as a branch
+	Swap(PlayedVoice.NoteTrackIndex, BranchVoice.NoteTrackIndex);
+	Swap(PlayedVoice.BeatTrackIndex, BranchVoice.BeatTrackIndex);
+	Swap(PlayedVoice.bIsDoubled, BranchVoice.bIsDoubled);
+
+	TArray<int32, TInlineAllocator<3>> TrackIndices;
+	TrackIndices.AddUnique(BranchVoice.NoteTrackIndex);
+	TrackIndices.AddUnique(BranchVoice.BeatTrackIndex);
+	if (BranchVoice.bIsDoubled)
+	{
+		TrackIndices.AddUnique(1);
+	}
 
-	GenerationHistory* History = GenThread->GetPipeline()->getHistory(GenThread->GetBatch());
-	//generationHistory_convert(History);
+	// Everything that hasn't been played yet is replaced by what the branch already generated
+	// The MIDI data is locked by the caller of DecodeTokens()
+	const int32 SwitchTick = CurrentTick;
+	for (int32 TrackIndex : TrackIndices)
+	{
+		MidiFileData->Tracks[TrackIndex].ClearEventsAfter(SwitchTick, true);
+		TrackStagers[TrackIndex].ClearEventsAfter(SwitchTick, true);
 
-	const struct Note* OutNotes;
-	size_t OutLength;
-	generationHistory_getNotes(History, &OutNotes, &OutLength);
+		// Cursor::TrackNextEventIndexs becomes 1 when reaching the end
+		// it's private, can't access it and can't modify or refresh it
+		// so instead, just add an event that's really far away
+		MidiFileData->Tracks[TrackIndex].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+	}
+	NbTrackCompactions++;
 
+	for (int32 EventIndex = 0; EventIndex < BranchVoice.UpcomingEvents.Num(); EventIndex++)
 	{
-		int counter = 0;
-		for (int i = 0; i < OutLength; i++)
+		const FGeneratedMidiEvent& UpcomingEvent = BranchVoice.UpcomingEvents[EventIndex];
+		const int32 TrackIndex = GetEventTrackIndex(BranchVoice, UpcomingEvent.Role);
+		if (TrackIndex != INDEX_NONE && UpcomingEvent.Event.GetTick() >= SwitchTick)
 		{
-			if (OutNotes[i].pitch == 70)
-			{
-				counter++;
-			}
+			TrackStagers[TrackIndex].AddEvent(UpcomingEvent.Event);
 		}
-		if (counter != prevCounter)
+	}
+}
+
+void FMIDIGeneratorEnv::DecodeTokens()
+{
+	// MIDI events are built by the gen thread, they only have to be added to the staged events of their track here
+
+	//const double StartTime = FPlatformTime::Seconds();
+
+	{
+		// The events are built from the notes, the tokens are only drained so the gen thread doesn't overrun the ring
+		FGeneratedToken NewToken;
+		while (GenThread->GeneratedTokens.Pop(NewToken))
 		{
-			UE_LOG(LogTemp, Warning, TEXT("= Nb Pitch 70 : %d ="), counter);
-			prevCounter = counter;
+			bShouldUpdateTokens = true;
 		}
+	}
+
+	uint32 RewindEpoch;
+	int32 LastRewindTick;
+	GenThread->GetLastRewind(RewindEpoch, LastRewindTick);
 
-		while (nextNoteIndexToProcess < OutLength)
+	if (RewindEpoch != LastSeenRewindEpoch)
+	{
+		LastSeenRewindEpoch = RewindEpoch;
+		for (FMIDIGeneratorVoice& Voice : Voices)
 		{
-			onNote(&args, OutNotes[nextNoteIndexToProcess]);
-			nextNoteIndexToProcess++;
+			Voice.UpcomingEvents.RemoveFromLibTick(LastRewindTick);
 		}
-
 	}
 
-	if (OutNotes != nullptr && OutLength != 0 && GenerateBeats)
 	{
-		GenThread->BeatGeneratorMutex.Lock();
-		beatGenerator_refresh(GenThread->beatGenerator, OutNotes+nextBeatNoteIndexToProcess, OutNotes + OutLength);
+		SCOPE_CYCLE_COUNTER(STAT_GenThread_SpliceMidiEvents);
 
-		const BeatNote* outBeatNotes;
-		int32_t outBeatsLength;
-		beatGenerator_getNotes(GenThread->beatGenerator, &outBeatNotes, &outBeatsLength);
-
-		for (const BeatNote* beatNote = outBeatNotes + nextBeatNoteIndexToProcess; beatNote < outBeatNotes + outBeatsLength; ++beatNote)
+		FGeneratedMidiEvent GeneratedEvent;
+		while (GeneratedEvents.Pop(GeneratedEvent))
 		{
-			// @TODO : switch on type
-			//beatNote->type;
-			
-			auto [Tick, Duration, Pitch, Velocity] = beatNote->note;
-			int32 Channel = 9;
-			Velocity = 40;
-			//Pitch = 80;
+			// Published by the gen thread in order with the events, see AdoptSamplingSetup() and UpdateBranches()
+			if (GeneratedEvent.Role == FGeneratedMidiEvent::ERole::BranchSwitch)
+			{
+				SwitchPlayedBatch(GeneratedEvent.BatchIndex);
+				continue;
+			}
+			if (GeneratedEvent.Role == FGeneratedMidiEvent::ERole::BranchFork)
+			{
+				Voices[GeneratedEvent.BatchIndex].UpcomingEvents.RemoveFromLibTick(GeneratedEvent.LibTick);
+				continue;
+			}
 
-			int32 OnTick = FMath::RoundToInt32(float(args.self->GenLibTickToUETick(Tick)));
-			int32 OffTick = FMath::RoundToInt32(float(args.self->GenLibTickToUETick(Tick + Duration * 8)));
+			// Built before a rewind, and removed by it
+			if (GeneratedEvent.Epoch != RewindEpoch && GeneratedEvent.LibTick >= LastRewindTick)
+			{
+				continue;
+			}
 
-			FMidiMsg Msg{ FMidiMsg::CreateNoteOn(Channel, Pitch, Velocity) };
-			args.self->MidiFileData->Tracks[1].AddEvent(FMidiEvent(OnTick, Msg));
+			FMIDIGeneratorVoice& Voice = Voices[GeneratedEvent.BatchIndex];
+			const int32 TrackIndex = GetEventTrackIndex(Voice, GeneratedEvent.Role);
+			// Branches aren't played
+			if (TrackIndex != INDEX_NONE)
+			{
+				TrackStagers[TrackIndex].AddEvent(GeneratedEvent.Event);
+			}
 
-			FMidiMsg OffMsg{ FMidiMsg::CreateNoteOff(Channel, Pitch) };
-			args.self->MidiFileData->Tracks[1].AddEvent(FMidiEvent(OffTick, OffMsg));
+			if (!Branches.IsEmpty())
+			{
+				Voice.UpcomingEvents.Add(GeneratedEvent);
+			}
 		}
-		args.self->MidiFileData->Tracks[1].Sort();
-		GenThread->BeatGeneratorMutex.Unlock();
+	}
 
-		nextBeatNoteIndexToProcess = outBeatsLength;
+	// Played events can't be switched to anymore
+	for (FMIDIGeneratorVoice& Voice : Voices)
+	{
+		Voice.UpcomingEvents.RemovePlayed(CurrentTick);
+	}
+
+	for (int32 TrackIndex = 0; TrackIndex < TrackStagers.Num(); TrackIndex++)
+	{
+		TrackStagers[TrackIndex].FlushIfNeeded(MidiFileData->Tracks[TrackIndex], CurrentTick, StagingHorizonTicks);
 	}
 
+	TrimConsumedEvents();
+
 	//const double EndTime = FPlatformTime::Seconds();
 	//const double Elapsed = EndTime - StartTime;
 
@@ -619,6 +1257,12 @@ void FMIDIGeneratorEnv::DecodeTokens()
 
 	//UE_LOG(LogTemp, Warning, TEXT("Max: %f"), MaxTime);
 
+	// Benchmarks decode without a clock
+	if (Clock == nullptr)
+	{
+		return;
+	}
+
 #if IS_VERSION_OR_PREV(5, 4)
 	float CurrentTimeMs = Clock->GetCurrentHiResMs();
 #elif IS_VERSION_OR_AFTER(5, 6)
@@ -633,13 +1277,86 @@ void FMIDIGeneratorEnv::DecodeTokens()
 
 	GenThread->CurrentTick = genLibTick;
 
-	// @TODO : thread safe
-	if (GenThread->ShouldResumeGeneration())
+	// The lookahead is targeted in ms, it needs the duration of a generation library tick at the playhead
+	const FTempoMap& TempoMap = MidiFileData->SongMaps.GetTempoMap();
+	const float MsPerLibTick = TempoMap.TickToMs(GenLibTickToUETick(genLibTick + 1)) - TempoMap.TickToMs(GenLibTickToUETick(genLibTick));
+	GenThread->Scheduler.SetMsPerTick(MsPerLibTick);
+
+	// Only reads atomics published by the gen thread
+	// No need to wake it up again until it has published since the last time
+	const uint32 GeneratedUntilVersion = GenThread->GetGeneratedUntilVersion();
+	if (GeneratedUntilVersion != LastWakeUpVersion && GenThread->ShouldResumeGeneration())
 	{
+		LastWakeUpVersion = GeneratedUntilVersion;
 		GenThread->Semaphore->Trigger();
 	}
 }
 
+// Tempo, time signature and control events are kept, they are needed by the song maps and the cursors
+bool FMIDIGeneratorEnv::RemoveNoteEventsBefore(FMidiTrack& Track, int32 Tick)
+{
+	// The track is sorted, only the events before Tick have to be looked at
+	const FMidiEventList& Events = Track.GetUnsortedEvents();
+	const int32 NbEventsBefore = Algo::LowerBoundBy(Events, Tick, [](const FMidiEvent& Event) { return Event.GetTick(); });
+
+	TrimmedTrackEvents.Reset();
+	for (int32 EventIndex = 0; EventIndex < NbEventsBefore; EventIndex++)
+	{
+		if (!Events[EventIndex].GetMsg().IsNoteMessage())
+		{
+			TrimmedTrackEvents.Add(Events[EventIndex]);
+		}
+	}
+
+	if (TrimmedTrackEvents.Num() == NbEventsBefore)
+	{
+		return false;
+	}
+
+	// The track has no way to remove its first events, so the kept ones are added back, still in tick order
+	TrimmedTrackEvents.Append(Events.GetData() + NbEventsBefore, Events.Num() - NbEventsBefore);
+	Track.ClearEventsAfter(0, true);
+	for (const FMidiEvent& Event : TrimmedTrackEvents)
+	{
+		Track.AddEvent(Event);
+	}
+	TrimmedTrackEvents.Reset();
+	return true;
+}
+
+void FMIDIGeneratorEnv::TrimConsumedEvents()
+{
+	if (NbRetainedBars < 0 || !MidiFileData.IsValid())
+	{
+		return;
+	}
+
+	const FSongMaps& SongMaps = MidiFileData->SongMaps;
+	const FTimeSignature* TimeSignature = SongMaps.GetTimeSignatureAtTick(CurrentTick);
+	const int32 Numerator = TimeSignature ? TimeSignature->Numerator : 4;
+	const int32 Denominator = TimeSignature ? TimeSignature->Denominator : 4;
+	const int32 TicksPerBar = SongMaps.GetTicksPerQuarterNote() * 4 * Numerator / Denominator;
+
+	// Compacting is linear in the track size, only do it once per bar
+	const int32 TrimTick = CurrentTick - NbRetainedBars * TicksPerBar;
+	if (TrimTick - LastTrimTick < TicksPerBar)
+	{
+		return;
+	}
+	LastTrimTick = TrimTick;
+
+	bool bHasCompacted = false;
+	for (int32 TrackIndex = 0; TrackIndex < TrackStagers.Num(); TrackIndex++)
+	{
+		bHasCompacted |= RemoveNoteEventsBefore(MidiFileData->Tracks[TrackIndex], TrimTick);
+	}
+
+	if (bHasCompacted)
+	{
+		NbTrackCompactions++;
+	}
+}
+
 void FMIDIGeneratorEnv::SetClock(const HarmonixMetasound::FMidiClock& InClock)
 {
 	Clock = &InClock;
@@ -669,29 +1386,21 @@ void FMIDIGeneratorEnv::RegenerateCacheFromTick(int32 UETick, int32 LibTick)
 #if IS_VERSION_OR_PREV(5, 4)
 	Clock->GetDrivingMidiPlayCursorMgr()->LockForMidiDataChanges();
 #endif
-	MidiFileData->Tracks[0].ClearEventsAfter(int32(UETick), true);
-	MidiFileData->Tracks[1].ClearEventsAfter(int32(UETick), true);
+	for (int32 TrackIndex = 0; TrackIndex < TrackStagers.Num(); TrackIndex++)
+	{
+		MidiFileData->Tracks[TrackIndex].ClearEventsAfter(int32(UETick), true);
+		TrackStagers[TrackIndex].ClearEventsAfter(int32(UETick), true);
 
-	// Cursor::TrackNextEventIndexs becomes 1 when reaching the end
-	// it's private, can't access it and can't modify or refresh it
-	// so instead, just add an event that's really far away
-	MidiFileData->Tracks[0].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
-	MidiFileData->Tracks[1].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+		// Cursor::TrackNextEventIndexs becomes 1 when reaching the end
+		// it's private, can't access it and can't modify or refresh it
+		// so instead, just add an event that's really far away
+		MidiFileData->Tracks[TrackIndex].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+	}
 
 #if IS_VERSION_OR_PREV(5, 4)
 	Clock->GetDrivingMidiPlayCursorMgr()->MidiDataChangeComplete(FMidiPlayCursorMgr::EMidiChangePositionCorrectMode::MaintainTick);
 #endif
 	ClockLock.Unlock();
-
-	GenThread->BeatGeneratorMutex.Lock();
-
-	const BeatNote* outBeatNotes;
-	int32_t outBeatsLength;
-	beatGenerator_getNotes(GenThread->beatGenerator, &outBeatNotes, &outBeatsLength);
-
-	nextBeatNoteIndexToProcess = outBeatsLength;
-
-	GenThread->BeatGeneratorMutex.Unlock();
 }
 
 void FMIDIGeneratorEnv::RegenerateCacheAfterDelay(float DelayInMs)
@@ -717,11 +1426,20 @@ void FMIDIGeneratorEnv::RegenerateCacheAfterDelay(float DelayInMs)
 #if IS_VERSION_OR_PREV(5, 4)
 	Clock->GetDrivingMidiPlayCursorMgr()->LockForMidiDataChanges();
 #endif
-	MidiFileData->Tracks[0].ClearEventsAfter(int32(GenLibTickToUETick(genLibTick)), true);
-	// Cursor::TrackNextEventIndexs becomes 1 when reaching the end
-	// it's private, can't access it and can't modify or refresh it
-	// so instead, just add an event that's really far away
-	MidiFileData->Tracks[0].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+	for (const FMIDIGeneratorVoice& Voice : Voices)
+	{
+		if (Voice.NoteTrackIndex == INDEX_NONE)
+		{
+			continue;
+		}
+
+		MidiFileData->Tracks[Voice.NoteTrackIndex].ClearEventsAfter(int32(GenLibTickToUETick(genLibTick)), true);
+		TrackStagers[Voice.NoteTrackIndex].ClearEventsAfter(int32(GenLibTickToUETick(genLibTick)), true);
+		// Cursor::TrackNextEventIndexs becomes 1 when reaching the end
+		// it's private, can't access it and can't modify or refresh it
+		// so instead, just add an event that's really far away
+		MidiFileData->Tracks[Voice.NoteTrackIndex].AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+	}
 
 #if IS_VERSION_OR_PREV(5, 4)
 	Clock->GetDrivingMidiPlayCursorMgr()->MidiDataChangeComplete(FMidiPlayCursorMgr::EMidiChangePositionCorrectMode::MaintainTick);
@@ -781,6 +1499,32 @@ void UMIDIGeneratorEnv::PreloadPipeline(const FString& ModelPath)
 	Generator->MidiGenerator->PreloadPipeline(ModelPath);
 }
 
+void UMIDIGeneratorEnv::PreloadPipelineAsync(const FString& ModelPath)
+{
+	TWeakObjectPtr<UMIDIGeneratorEnv> WeakThis(this);
+	Generator->MidiGenerator->PreloadPipelineAsync(ModelPath,
+		[WeakThis](float Progress)
+		{
+			AsyncTask(ENamedThreads::GameThread, [WeakThis, Progress]()
+				{
+					if (UMIDIGeneratorEnv* This = WeakThis.Get())
+					{
+						This->OnPipelineLoadingProgress.Broadcast(Progress);
+					}
+				});
+		},
+		[WeakThis](bool bSuccess)
+		{
+			AsyncTask(ENamedThreads::GameThread, [WeakThis, bSuccess]()
+				{
+					if (UMIDIGeneratorEnv* This = WeakThis.Get())
+					{
+						This->OnPipelineLoaded.Broadcast(bSuccess);
+					}
+				});
+		});
+}
+
 void UMIDIGeneratorEnv::SetFilter()
 {
 	Generator->MidiGenerator->SetFilter();
@@ -801,6 +1545,21 @@ void UMIDIGeneratorEnv::AddFireworkEffect()
 	Generator->MidiGenerator->AddFireworkEffect();
 }
 
+void UMIDIGeneratorEnv::SetNbVoices(int32 NbVoices)
+{
+	Generator->MidiGenerator->SetNbVoices(NbVoices);
+}
+
+int32 UMIDIGeneratorEnv::AddBranch(const FMIDIGenerationSettings& Settings)
+{
+	return Generator->MidiGenerator->AddBranch(Settings);
+}
+
+void UMIDIGeneratorEnv::SwitchToBranch(int32 BranchIndex)
+{
+	Generator->MidiGenerator->SwitchToBranch(BranchIndex);
+}
+
 void UMIDIGeneratorEnv::SetTempo(float InTempo)
 {
 	Generator->MidiGenerator->SetTempo(InTempo);
@@ -813,60 +1572,12 @@ void UMIDIGeneratorEnv::RegenerateCacheAfterDelay(float DelayInMs)
 
 void UMIDIGeneratorEnv::SetScale(EScale Scale)
 {
-	using namespace Scales;
-	switch (Scale)
-	{
-		case EScale::IonianMajor:
-			Generator->MidiGenerator->Scale = Ionian::Major::get();
-			Generator->MidiGenerator->ScaleSize = Ionian::Major::size();
-			break;
-		case EScale::Mixolydian:
-			Generator->MidiGenerator->Scale = Mixolydian::get();
-			Generator->MidiGenerator->ScaleSize = Mixolydian::size();
-			break;
-		case EScale::MelodicMinor:
-			Generator->MidiGenerator->Scale = Melodic::Minor::get();
-			Generator->MidiGenerator->ScaleSize = Melodic::Minor::size();
-			break;
-		case EScale::HarmonicMinor:
-			Generator->MidiGenerator->Scale = Harmonic::Minor::get();
-			Generator->MidiGenerator->ScaleSize = Harmonic::Minor::size();
-			break;
-		case EScale::WholeTone:
-			Generator->MidiGenerator->Scale = WholeTone::get();
-			Generator->MidiGenerator->ScaleSize = WholeTone::size();
-			break;
-		case EScale::Blues:
-			Generator->MidiGenerator->Scale = Blues::get();
-			Generator->MidiGenerator->ScaleSize = Blues::size();
-			break;
-		case EScale::PentatonicMajor:
-			Generator->MidiGenerator->Scale = Pentatonic::Major::get();
-			Generator->MidiGenerator->ScaleSize = Pentatonic::Major::size();
-			break;
-		case EScale::PentatonicMinor:
-			Generator->MidiGenerator->Scale = Pentatonic::Minor::get();
-			Generator->MidiGenerator->ScaleSize = Pentatonic::Minor::size();
-			break;
-		case EScale::HungarianMinor:
-			Generator->MidiGenerator->Scale = Hungarian::Minor::get();
-			Generator->MidiGenerator->ScaleSize = Hungarian::Minor::size();
-			break;
-		case EScale::Byzantine:
-			Generator->MidiGenerator->Scale = Byzantine::get();
-			Generator->MidiGenerator->ScaleSize = Byzantine::size();
-			break;
-		case EScale::Diminished:
-			Generator->MidiGenerator->Scale = Diminished::get();
-			Generator->MidiGenerator->ScaleSize = Diminished::size();
-			break;
-	}
+	Generator->MidiGenerator->SetScale(Scale);
 }
 
 void UMIDIGeneratorEnv::SetPitchRange(int32 MinPitch, int32 MaxPitch)
 {
-	Generator->MidiGenerator->minPitch = MinPitch;
-	Generator->MidiGenerator->maxPitch = MaxPitch;
+	Generator->MidiGenerator->SetPitchRange(MinPitch, MaxPitch);
 }
 
 void UMIDIGeneratorEnv::GetPitchRange(int32& OutMinPitch, int32& OutMaxPitch) const
@@ -877,8 +1588,7 @@ void UMIDIGeneratorEnv::GetPitchRange(int32& OutMinPitch, int32& OutMaxPitch) co
 
 void UMIDIGeneratorEnv::SetTimeShiftRange(float MinTimeShift, float MaxTimeShift)
 {
-	Generator->MidiGenerator->minTimeShift = MinTimeShift;
-	Generator->MidiGenerator->maxTimeShift = MaxTimeShift;
+	Generator->MidiGenerator->SetTimeShiftRange(MinTimeShift, MaxTimeShift);
 }
 
 void UMIDIGeneratorEnv::GetTimeShiftRange(float& OutMinTimeShift, float& OutMaxTimeShift) const
@@ -887,6 +1597,11 @@ void UMIDIGeneratorEnv::GetTimeShiftRange(float& OutMinTimeShift, float& OutMaxT
 	OutMaxTimeShift = Generator->MidiGenerator->maxTimeShift;
 }
 
+void UMIDIGeneratorEnv::SetSamplingMode(ESamplingMode SamplingMode)
+{
+	Generator->MidiGenerator->SamplingMode = SamplingMode;
+}
+
 void UMIDIGeneratorEnv::SetGenerateBeats(bool doesGenerate)
 {
 	Generator->MidiGenerator->GenerateBeats = doesGenerate;
@@ -897,7 +1612,95 @@ void UMIDIGeneratorEnv::SetPlayFireworkEffect(bool shouldPlayEffect)
 	Generator->MidiGenerator->PlayFireworkEffect = shouldPlayEffect;
 }
 
+void UMIDIGeneratorEnv::SetRetentionWindow(int32 NbBars)
+{
+	Generator->MidiGenerator->NbRetainedBars = NbBars;
+}
+
+void UMIDIGeneratorEnv::SetLookahead(float TargetLookaheadMs, float HysteresisMs)
+{
+	Generator->MidiGenerator->GenThread->Scheduler.SetTargetLookahead(TargetLookaheadMs, HysteresisMs);
+}
+
 TSharedPtr<Audio::IProxyData> UMIDIGeneratorEnv::CreateProxyData(const Audio::FProxyDataInitParams& InitParams)
 {
 	return MakeShared<FMIDIGeneratorProxy, ESPMode::ThreadSafe>(this);
-}
\ No newline at end of file
+}
+
+#if !UE_BUILD_SHIPPING
+#include "HAL/IConsoleManager.h"
+
+namespace DecodeTokensBenchmark
+{
+	// Sorted track similar to the generated ones, ending with the far away AllNotesKill event
+	FMidiTrack MakeTrack(int32 NbEvents)
+	{
+		FMidiTrack Track;
+		for (int32 i = 0; i < NbEvents / 2; i++)
+		{
+			Track.AddEvent(FMidiEvent(i * 100, FMidiMsg::CreateNoteOn(0, 60, 100)));
+			Track.AddEvent(FMidiEvent(i * 100 + 80, FMidiMsg::CreateNoteOff(0, 60)));
+		}
+		Track.AddEvent(FMidiEvent(TNumericLimits<int32>::Max(), FMidiMsg::CreateAllNotesKill()));
+		Track.Sort();
+		return Track;
+	}
+
+	// Usage : MIDIGen.Bench.DecodeTokens [NbNotesPerDecode]
+	void Run(const TArray<FString>& Args)
+	{
+		const int32 NbNotes = 1024;
+		const int32 NbNotesPerDecode = Args.Num() > 0 ? FMath::Clamp(FCString::Atoi(*Args[0]), 1, 512) : 1;
+
+		for (int32 NbEvents : { 1000, 10000, 25000, 50000, 100000 })
+		{
+			const int32 FirstTick = NbEvents * 50;
+
+			// Previous behavior, for reference
+			FMidiTrack SortedTrack = MakeTrack(NbEvents);
+			double StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < NbNotes; i++)
+			{
+				SortedTrack.AddEvent(FMidiEvent(FirstTick + i * 100, FMidiMsg::CreateNoteOn(0, 60, 100)));
+				SortedTrack.AddEvent(FMidiEvent(FirstTick + i * 100 + 80, FMidiMsg::CreateNoteOff(0, 60)));
+				SortedTrack.Sort();
+			}
+			const double SortPerNoteUs = (FPlatformTime::Seconds() - StartTime) * 1e6 / NbNotes;
+
+			// One voice playing a single track, without clock nor gen thread, the events are pushed as the gen thread would
+			TSharedPtr<FMIDIGeneratorEnv> Env = MakeShared<FMIDIGeneratorEnv>();
+			Env->MidiFileData = MakeShared<FMidiFileData>();
+			Env->MidiFileData->Tracks.Add(MakeTrack(NbEvents));
+			Env->TrackStagers.SetNum(1);
+			Env->Voices.SetNum(1);
+			Env->NbRetainedBars = -1;
+			// Every staged event is about to be played, so each call flushes
+			Env->CurrentTick = FirstTick + NbNotes * 100;
+
+			double WorstDecodeUs = 0.0;
+			StartTime = FPlatformTime::Seconds();
+			for (int32 i = 0; i < NbNotes; i += NbNotesPerDecode)
+			{
+				for (int32 NoteIndex = i; NoteIndex < FMath::Min(i + NbNotesPerDecode, NbNotes); NoteIndex++)
+				{
+					Env->GeneratedEvents.Push(FGeneratedMidiEvent{ FMidiEvent(FirstTick + NoteIndex * 100, FMidiMsg::CreateNoteOn(0, 60, 100)) });
+					Env->GeneratedEvents.Push(FGeneratedMidiEvent{ FMidiEvent(FirstTick + NoteIndex * 100 + 80, FMidiMsg::CreateNoteOff(0, 60)) });
+				}
+
+				const double DecodeStartTime = FPlatformTime::Seconds();
+				Env->DecodeTokens();
+				WorstDecodeUs = FMath::Max(WorstDecodeUs, (FPlatformTime::Seconds() - DecodeStartTime) * 1e6);
+			}
+			const double DecodePerNoteUs = (FPlatformTime::Seconds() - StartTime) * 1e6 / NbNotes;
+
+			UE_LOG(LogTemp, Display, TEXT("DecodeTokens | %6d events | Sort per note: %9.2f us/note | DecodeTokens (%d notes per call): %9.2f us/note, worst call %9.2f us | %d events in the track"),
+				NbEvents, SortPerNoteUs, NbNotesPerDecode, DecodePerNoteUs, WorstDecodeUs, Env->MidiFileData->Tracks[0].GetUnsortedEvents().Num());
+		}
+	}
+
+	FAutoConsoleCommand Command(
+		TEXT("MIDIGen.Bench.DecodeTokens"),
+		TEXT("Cost of DecodeTokens adding generated notes to a track, for track lengths up to 100k events, compared to sorting after each note."),
+		FConsoleCommandWithArgsDelegate::CreateStatic(&Run));
+}
+#endif
@@ -1,6 +1,7 @@
 // Copyright Prog'z. All Rights Reserved.
 
 #include "MIDIGeneratorWrapper.h"
+#include "ThreadAllocationCounter.h"
 #include "Misc/MessageDialog.h"
 #include "Modules/ModuleManager.h"
 #include "Interfaces/IPluginManager.h"
@@ -16,6 +17,9 @@ void FMIDIGeneratorWrapperModule::StartupModule()
 {
 	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
 
+	// Before anything of the plugin allocates
+	FThreadAllocationCounter::Install();
+
 	// Get the base directory of this plugin
 	//FString BaseDir = IPluginManager::Get().FindPlugin("MIDIGeneratorWrapper")->GetBaseDir();
 
@@ -61,6 +65,8 @@ void FMIDIGeneratorWrapperModule::ShutdownModule()
 	// Free the dll handle
 	FPlatformProcess::FreeDllHandle(ExampleLibraryHandle);
 	ExampleLibraryHandle = nullptr;
+
+	FThreadAllocationCounter::Uninstall();
 }
 
 #undef LOCTEXT_NAMESPACE
@@ -0,0 +1,180 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "MIDIModelPool.h"
+#include "modelBuilderManager.hpp"
+#include "abstractPipeline.hpp"
+
+FPooledMIDIModel::FPooledMIDIModel(EnvHandle InEnv, AModel* InModel, const FString& InModelPath)
+	: Env(InEnv)
+	, Model(InModel)
+	, ModelPath(InModelPath)
+{
+}
+
+FPooledMIDIModel::~FPooledMIDIModel()
+{
+	// Every pipeline in use holds a reference to the model, only idle ones are left
+	if (!IdlePipelines.IsEmpty())
+	{
+		UE_LOG(LogTemp, Log, TEXT("Unloading %s, %d idle pipelines can't be destroyed and are abandoned"), *ModelPath, IdlePipelines.Num());
+		IdlePipelines.Reset();
+	}
+
+	// The session must be released before its env
+	delete Model;
+	Model = nullptr;
+
+	if (Env != nullptr)
+	{
+		destroyEnv(Env);
+		Env = nullptr;
+	}
+}
+
+FMIDIPipelinePtr FPooledMIDIModel::AcquirePipeline()
+{
+	PipelinesMutex.Lock();
+	IAutoRegressivePipeline* Pipeline = IdlePipelines.IsEmpty() ? nullptr : IdlePipelines.Pop(EAllowShrinking::No);
+	PipelinesMutex.Unlock();
+
+	if (Pipeline == nullptr)
+	{
+		Pipeline = (IAutoRegressivePipeline*)Model->createPipeline(); // @TODO : dynamic cast
+		if (Pipeline == nullptr)
+		{
+			return nullptr;
+		}
+	}
+
+	TSharedPtr<FPooledMIDIModel, ESPMode::ThreadSafe> This = AsShared();
+	return FMIDIPipelinePtr(Pipeline, [This](IAutoRegressivePipeline* ReleasedPipeline)
+		{
+			This->ReleasePipeline(ReleasedPipeline);
+		});
+}
+
+void FPooledMIDIModel::ReleasePipeline(IAutoRegressivePipeline* Pipeline)
+{
+	// The next generator adds its own batches, histories and observers
+	Pipeline->removeAllBatches();
+	Pipeline->reset();
+
+	PipelinesMutex.Lock();
+	IdlePipelines.Add(Pipeline);
+	PipelinesMutex.Unlock();
+}
+
+int32 FPooledMIDIModel::GetNbIdlePipelines()
+{
+	PipelinesMutex.Lock();
+	const int32 NbIdlePipelines = IdlePipelines.Num();
+	PipelinesMutex.Unlock();
+	return NbIdlePipelines;
+}
+
+FMIDIModelPool& FMIDIModelPool::Get()
+{
+	static FMIDIModelPool Pool;
+	return Pool;
+}
+
+FPooledMIDIModelPtr FMIDIModelPool::FindOrLoad(const FString& AbsoluteModelPath)
+{
+	FString Key = AbsoluteModelPath;
+	FPaths::NormalizeDirectoryName(Key);
+
+	Mutex.Lock();
+
+	if (TWeakPtr<FPooledMIDIModel, ESPMode::ThreadSafe>* WeakModel = Models.Find(Key))
+	{
+		if (FPooledMIDIModelPtr Model = WeakModel->Pin())
+		{
+			Mutex.Unlock();
+			return Model;
+		}
+	}
+
+	// Two generators asking for the same model at the same time don't load it twice
+	if (const TSharedFuture<FPooledMIDIModelPtr>* PendingLoad = PendingLoads.Find(Key))
+	{
+		const TSharedFuture<FPooledMIDIModelPtr> Future = *PendingLoad;
+		Mutex.Unlock();
+		return Future.Get();
+	}
+
+	TPromise<FPooledMIDIModelPtr> Promise;
+	PendingLoads.Add(Key, Promise.GetFuture().Share());
+	Mutex.Unlock();
+
+	// Loading takes seconds, the other models can be found in the meantime
+	FPooledMIDIModelPtr Model = Load(Key);
+
+	Mutex.Lock();
+	if (Model.IsValid())
+	{
+		Models.Add(Key, Model);
+	}
+	PendingLoads.Remove(Key);
+	Mutex.Unlock();
+
+	Promise.SetValue(Model);
+	return Model;
+}
+
+FPooledMIDIModelPtr FMIDIModelPool::Load(const FString& Key)
+{
+	EnvHandle Env = createEnv(false);
+
+	ModelLoadingParamsWrapper Params;
+	CResult Result = createModelLoadingParamsWrapperFromFolder(TCHAR_TO_UTF8(*Key), &Params);
+	if (!ResultIsSuccess(&Result))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load model parameters from folder %s"), *Key);
+		destroyEnv(Env);
+		return nullptr;
+	}
+
+	CppStr ModelType = Params.getModelType();
+	OnnxModelBuilder* Builder = getModelBuilderManager().findBuilder<OnnxModelBuilder>(ModelType.Str());
+	if (Builder == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("No builder registered for model type %hs"), ModelType.Str());
+		destroyEnv(Env);
+		return nullptr;
+	}
+
+	// The builder's env isn't changed by another load in the meantime
+	BuilderMutex.Lock();
+	Builder->env = Env;
+	AModel* LoadedModel = Builder->loadModelFromWrapper(Params);
+	BuilderMutex.Unlock();
+
+	if (LoadedModel == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load model from folder %s"), *Key);
+		destroyEnv(Env);
+		return nullptr;
+	}
+
+	return MakeShared<FPooledMIDIModel, ESPMode::ThreadSafe>(Env, LoadedModel, Key);
+}
+
+int32 FMIDIModelPool::GetNbLoadedModels()
+{
+	Mutex.Lock();
+	int32 NbLoadedModels = 0;
+	for (auto It = Models.CreateIterator(); It; ++It)
+	{
+		if (It.Value().IsValid())
+		{
+			NbLoadedModels++;
+		}
+		else
+		{
+			It.RemoveCurrent();
+		}
+	}
+	Mutex.Unlock();
+	return NbLoadedModels;
+}
@@ -0,0 +1,77 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "MidiEventStager.h"
+#include "Algo/BinarySearch.h"
+#include "Algo/StableSort.h"
+
+void FMidiEventStager::AddEvent(const FMidiEvent& Event)
+{
+	PendingEvents.Add(Event);
+	EarliestTick = FMath::Min(EarliestTick, Event.GetTick());
+}
+
+void FMidiEventStager::ClearEventsAfter(int32 Tick, bool IncludeTick)
+{
+	// Order preserving, so events on the same tick keep their insertion order once merged into the track
+	PendingEvents.RemoveAll([Tick, IncludeTick](const FMidiEvent& Event)
+		{
+			return IncludeTick ? Event.GetTick() >= Tick : Event.GetTick() > Tick;
+		});
+
+	EarliestTick = TNumericLimits<int32>::Max();
+	for (const FMidiEvent& Event : PendingEvents)
+	{
+		EarliestTick = FMath::Min(EarliestTick, Event.GetTick());
+	}
+}
+
+void FMidiEventStager::FlushTo(FMidiTrack& Track)
+{
+	if (PendingEvents.IsEmpty())
+	{
+		return;
+	}
+
+	// Stable, so events on the same tick keep their generation order
+	Algo::StableSortBy(PendingEvents, [](const FMidiEvent& Event) { return Event.GetTick(); });
+	const int32 FirstTick = PendingEvents[0].GetTick();
+
+	// Generated events are almost always after every event of the track but the far away one,
+	// so only the few events after the first staged one are taken out and merged back
+	const FMidiEventList& Events = Track.GetUnsortedEvents();
+	const int32 TailIndex = Algo::UpperBoundBy(Events, FirstTick, [](const FMidiEvent& Event) { return Event.GetTick(); });
+	TailEvents.Reset();
+	TailEvents.Append(Events.GetData() + TailIndex, Events.Num() - TailIndex);
+	if (!TailEvents.IsEmpty())
+	{
+		Track.ClearEventsAfter(FirstTick, false);
+	}
+
+	// Events are added in tick order, so the track never has to be sorted again
+	// Events already in the track go first on the same tick, as Sort() would keep them
+	int32 PendingIndex = 0;
+	int32 TailIndexToAdd = 0;
+	while (PendingIndex < PendingEvents.Num() || TailIndexToAdd < TailEvents.Num())
+	{
+		const bool bIsTailNext = TailIndexToAdd < TailEvents.Num()
+			&& (PendingIndex == PendingEvents.Num() || TailEvents[TailIndexToAdd].GetTick() <= PendingEvents[PendingIndex].GetTick());
+		Track.AddEvent(bIsTailNext ? TailEvents[TailIndexToAdd++] : PendingEvents[PendingIndex++]);
+	}
+
+	PendingEvents.Reset();
+	TailEvents.Reset();
+	EarliestTick = TNumericLimits<int32>::Max();
+}
+
+bool FMidiEventStager::FlushIfNeeded(FMidiTrack& Track, int32 CurrentTick, int32 HorizonTicks)
+{
+	// Compared in int64 since the horizon can go past the end of the song
+	if (PendingEvents.IsEmpty() || int64(EarliestTick) > int64(CurrentTick) + HorizonTicks)
+	{
+		return false;
+	}
+
+	FlushTo(Track);
+	return true;
+}
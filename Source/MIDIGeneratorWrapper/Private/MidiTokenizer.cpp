@@ -2,70 +2,105 @@
 
 
 #include "MidiTokenizer.h"
-//
-//void _OnPitch(void* data, unsigned char pitch)
-//{
-//	if (data == nullptr)
-//		return;
-//
-//	int32 pitchInt = int32(pitch);
-//
-//	//FMidiMsg& msg = * (FMidiMsg*) data;
-//
-//	//msg = FMidiMsg::CreateNoteOn(channel, note, velocity);
-//
-//
-//	//if (GEngine)
-//	//{
-//	//	GEngine->AddOnScreenDebugMessage(-1, 5.0f, FColor::Green, FString::Printf(TEXT("%d"), pitchInt));
-//	//}
-//
-//	//((UMIDIGenerator*)data)->OnPitch(pitchInt);
-//}
+#include "midiConverter.h"
+#include "midiConverter.hpp"
 
-FMidiConverter::FMidiConverter()
+static void OnConverterNote(void* data, const Note& newNote)
 {
-	//redirector_bindPitch(redirector, tok, "Pitch_", this, _OnPitch);
-
+	FMidiConverter& MidiConverter = *(FMidiConverter*)(data);
+	MidiConverter.unplayedTokenIndex = MidiConverter.GetProcessedTokenIndex() + 1;
 
+	if (MidiConverter.OnNote && !MidiConverter.IsReplaying())
+	{
+		MidiConverter.OnNote(newNote);
+	}
+}
 
+FMidiConverter::FMidiConverter()
+{
+	createConverter();
 }
 
 FMidiConverter::~FMidiConverter()
 {
+	if (converter)
+	{
+		destroyMidiConverter(converter);
+		converter = nullptr;
+	}
 }
 
-
-void FMidiConverter::update()
+void FMidiConverter::setTokenizer(MidiTokenizerHandle InTokenizer)
 {
-    std::int32_t i = unplayedTokenIndex;
-
-    struct Args
-    {
-        std::int32_t& i;
-        std::int32_t& unplayedTokenIndex;
-    };
-
-    Args args{ i, unplayedTokenIndex };
-
-    MidiConverterHandle converter = createTSDConverter();
-    converterSetOnNote(converter, [](void* data, const Note& newNote)
-        {
-            Args& args = *(Args*)(data);
-            args.unplayedTokenIndex = args.i + 1;
+	check(nextTokenIndexToProcess == 0);
 
+	tok = InTokenizer;
+	createConverter();
+}
 
+void FMidiConverter::createConverter()
+{
+	if (converter)
+	{
+		destroyMidiConverter(converter);
+	}
+
+	if (tok)
+	{
+		converter = createConverterFromTokenizer(tok);
+		bCanUndo = FCStringAnsi::Strcmp(tokenizer_getTokenizationType(tok), "TSD") == 0;
+	}
+	else
+	{
+		converter = createTSDConverter();
+		bCanUndo = true;
+	}
+	converterSetOnNote(converter, &OnConverterNote);
+}
 
-        });
-
-
-    while (i < tokens.Num())
-    {
-        int j = i;
-        converterProcessToken(converter, tokens.GetData(), tokens.Num(), &j, &args);
-        //converter.processToken(tokens, i, &args);
-        i++;
-    }
+void FMidiConverter::update()
+{
+	// Only the new tokens are processed, the converter keeps the current tick and the previous note end
+	const int32 nbCompleteTokens = tokens.Num() - NbNoteLookaheadTokens;
+	for (; nextTokenIndexToProcess < nbCompleteTokens; nextTokenIndexToProcess++)
+	{
+		int32 j = nextTokenIndexToProcess;
+		converterProcessToken(converter, tokens.GetData(), tokens.Num(), &j, this);
+	}
+}
 
-    destroyMidiConverter(converter);
-}
\ No newline at end of file
+void FMidiConverter::removeTokensFrom(int32 TokenIndex)
+{
+	TokenIndex = FMath::Clamp(TokenIndex, 0, tokens.Num());
+
+	if (bCanUndo)
+	{
+		// Each processed token is undone, the newest first
+		for (; nextTokenIndexToProcess > TokenIndex; nextTokenIndexToProcess--)
+		{
+			converter->undo();
+		}
+		tokens.SetNum(TokenIndex, EAllowShrinking::No);
+	}
+	else if (nextTokenIndexToProcess > TokenIndex)
+	{
+		// undo() does nothing, the state after the kept tokens is rebuilt from the start
+		// Notes that needed the removed tokens are converted again by the next update()
+		tokens.SetNum(TokenIndex, EAllowShrinking::No);
+		createConverter();
+		bIsReplaying = true;
+		const int32 nbCompleteTokens = TokenIndex - NbNoteLookaheadTokens;
+		for (nextTokenIndexToProcess = 0; nextTokenIndexToProcess < nbCompleteTokens; nextTokenIndexToProcess++)
+		{
+			int32 j = nextTokenIndexToProcess;
+			converterProcessToken(converter, tokens.GetData(), tokens.Num(), &j, this);
+		}
+		bIsReplaying = false;
+	}
+	else
+	{
+		tokens.SetNum(TokenIndex, EAllowShrinking::No);
+	}
+
+	unplayedTokenIndex = FMath::Min(unplayedTokenIndex, TokenIndex);
+}
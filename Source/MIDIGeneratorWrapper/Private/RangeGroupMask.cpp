@@ -0,0 +1,120 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "RangeGroupMask.h"
+#include "gen.h"
+#include "range.h"
+
+namespace RangeGroupMask
+{
+	// Words per vector register
+	static constexpr int32 NbWordsPerVector = 2;
+
+	int32 GetNbWords(int32 VocabSize)
+	{
+		return Align(FMath::DivideAndRoundUp(VocabSize, 64), NbWordsPerVector);
+	}
+}
+
+FRangeGroupMask FRangeGroupMask::FromSpans(TArrayView<const FLogitsKernel::FSpan> InSpans, int32 InVocabSize)
+{
+	FRangeGroupMask Mask;
+	Mask.VocabSize = InVocabSize;
+	Mask.Bits.SetNumZeroed(RangeGroupMask::GetNbWords(InVocabSize));
+	for (const FLogitsKernel::FSpan& Span : InSpans)
+	{
+		const int32 End = FMath::Min(Span.Begin + Span.Size, InVocabSize);
+		for (int32 Token = FMath::Max(Span.Begin, 0); Token < End; Token++)
+		{
+			Mask.Bits[Token >> 6] |= uint64(1) << (Token & 63);
+		}
+	}
+	Mask.BuildFromBits();
+	return Mask;
+}
+
+FRangeGroupMask FRangeGroupMask::FromRangeGroup(RangeGroupHandle RangeGroup, int32 InVocabSize)
+{
+	const Range* Ranges;
+	size_t NbRanges;
+	rangeGroupGetRanges(RangeGroup, &Ranges, &NbRanges);
+
+	TArray<FLogitsKernel::FSpan> RangeSpans;
+	RangeSpans.Reserve(int32(NbRanges));
+	for (size_t r = 0; r < NbRanges; r++)
+	{
+		RangeSpans.Add(FLogitsKernel::FSpan{ Ranges[r].min, int32(rangeSize(&Ranges[r])) });
+	}
+	return FromSpans(RangeSpans, InVocabSize);
+}
+
+template<typename FCombine>
+FRangeGroupMask FRangeGroupMask::Combine(const FRangeGroupMask& A, const FRangeGroupMask& B, FCombine CombineWords)
+{
+	const FRangeGroupMask& Larger = A.Bits.Num() >= B.Bits.Num() ? A : B;
+	const FRangeGroupMask& Smaller = A.Bits.Num() >= B.Bits.Num() ? B : A;
+
+	FRangeGroupMask Mask;
+	Mask.VocabSize = FMath::Max(A.VocabSize, B.VocabSize);
+	Mask.Bits.SetNumZeroed(Larger.Bits.Num());
+
+	// Both are padded to a whole number of registers, the words past the smaller mask are combined with 0
+	const uint64* LargerBits = Larger.Bits.GetData();
+	const uint64* SmallerBits = Smaller.Bits.GetData();
+	uint64* OutBits = Mask.Bits.GetData();
+	int32 WordIndex = 0;
+	for (; WordIndex < Smaller.Bits.Num(); WordIndex += RangeGroupMask::NbWordsPerVector)
+	{
+		VectorIntStoreAligned(CombineWords(VectorIntLoadAligned(LargerBits + WordIndex), VectorIntLoadAligned(SmallerBits + WordIndex)), OutBits + WordIndex);
+	}
+	for (; WordIndex < Larger.Bits.Num(); WordIndex += RangeGroupMask::NbWordsPerVector)
+	{
+		VectorIntStoreAligned(CombineWords(VectorIntLoadAligned(LargerBits + WordIndex), GlobalVectorConstants::IntZero), OutBits + WordIndex);
+	}
+
+	Mask.BuildFromBits();
+	return Mask;
+}
+
+FRangeGroupMask FRangeGroupMask::And(const FRangeGroupMask& A, const FRangeGroupMask& B)
+{
+	return Combine(A, B, [](const VectorRegister4Int& X, const VectorRegister4Int& Y) { return VectorIntAnd(X, Y); });
+}
+
+FRangeGroupMask FRangeGroupMask::Or(const FRangeGroupMask& A, const FRangeGroupMask& B)
+{
+	return Combine(A, B, [](const VectorRegister4Int& X, const VectorRegister4Int& Y) { return VectorIntOr(X, Y); });
+}
+
+void FRangeGroupMask::BuildFromBits()
+{
+	Spans.Reset();
+	Indices.Reset();
+
+	int32 NbTokens = 0;
+	for (uint64 Word : Bits)
+	{
+		NbTokens += FMath::CountBits(Word);
+	}
+	Indices.Reserve(NbTokens);
+
+	for (int32 WordIndex = 0; WordIndex < Bits.Num(); WordIndex++)
+	{
+		uint64 Word = Bits[WordIndex];
+		while (Word != 0)
+		{
+			const int32 Token = WordIndex * 64 + int32(FMath::CountTrailingZeros64(Word));
+			Word &= Word - 1;
+
+			Indices.Add(Token);
+			if (Spans.Num() > 0 && Spans.Last().Begin + Spans.Last().Size == Token)
+			{
+				Spans.Last().Size++;
+			}
+			else
+			{
+				Spans.Add(FLogitsKernel::FSpan{ Token, 1 });
+			}
+		}
+	}
+}
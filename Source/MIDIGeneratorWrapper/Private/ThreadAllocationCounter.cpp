@@ -0,0 +1,202 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "ThreadAllocationCounter.h"
+#include "HAL/PlatformAtomics.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+
+namespace ThreadAllocationCounter
+{
+	thread_local uint32 NbAllocations = 0;
+	std::atomic_bool bIsEnabled = false;
+
+	class FCountingMalloc final : public FMalloc
+	{
+	public:
+		explicit FCountingMalloc(FMalloc* InInnerMalloc) : InnerMalloc(InInnerMalloc) {}
+
+		virtual void* Malloc(SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->Malloc(Count, Alignment);
+		}
+
+		virtual void* TryMalloc(SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->TryMalloc(Count, Alignment);
+		}
+
+		virtual void* MallocZeroed(SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->MallocZeroed(Count, Alignment);
+		}
+
+		virtual void* TryMallocZeroed(SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->TryMallocZeroed(Count, Alignment);
+		}
+
+		virtual void* Realloc(void* Original, SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->Realloc(Original, Count, Alignment);
+		}
+
+		virtual void* TryRealloc(void* Original, SIZE_T Count, uint32 Alignment) override
+		{
+			NbAllocations++;
+			return InnerMalloc->TryRealloc(Original, Count, Alignment);
+		}
+
+		virtual void Free(void* Original) override
+		{
+			InnerMalloc->Free(Original);
+		}
+
+		virtual bool GetAllocationSize(void* Original, SIZE_T& SizeOut) override
+		{
+			return InnerMalloc->GetAllocationSize(Original, SizeOut);
+		}
+
+		virtual SIZE_T QuantizeSize(SIZE_T Count, uint32 Alignment) override
+		{
+			return InnerMalloc->QuantizeSize(Count, Alignment);
+		}
+
+		virtual void Trim(bool bTrimThreadCaches) override
+		{
+			InnerMalloc->Trim(bTrimThreadCaches);
+		}
+
+		virtual uint64 GetImmediatelyFreeableCachedMemorySize() const override
+		{
+			return InnerMalloc->GetImmediatelyFreeableCachedMemorySize();
+		}
+
+		virtual void SetupTLSCachesOnCurrentThread() override
+		{
+			InnerMalloc->SetupTLSCachesOnCurrentThread();
+		}
+
+		virtual void MarkTLSCachesAsUsedOnCurrentThread() override
+		{
+			InnerMalloc->MarkTLSCachesAsUsedOnCurrentThread();
+		}
+
+		virtual void MarkTLSCachesAsUnusedOnCurrentThread() override
+		{
+			InnerMalloc->MarkTLSCachesAsUnusedOnCurrentThread();
+		}
+
+		virtual void ClearAndDisableTLSCachesOnCurrentThread() override
+		{
+			InnerMalloc->ClearAndDisableTLSCachesOnCurrentThread();
+		}
+
+		virtual void InitializeStatsMetadata() override
+		{
+			InnerMalloc->InitializeStatsMetadata();
+		}
+
+		virtual void GetAllocatorStats(FGenericMemoryStats& OutStats) override
+		{
+			InnerMalloc->GetAllocatorStats(OutStats);
+		}
+
+		virtual void DumpAllocatorStats(FOutputDevice& Ar) override
+		{
+			InnerMalloc->DumpAllocatorStats(Ar);
+		}
+
+		virtual bool IsInternallyThreadSafe() const override
+		{
+			return InnerMalloc->IsInternallyThreadSafe();
+		}
+
+		virtual bool ValidateHeap() override
+		{
+			return InnerMalloc->ValidateHeap();
+		}
+
+		virtual void UpdateStats() override
+		{
+			InnerMalloc->UpdateStats();
+		}
+
+		virtual const TCHAR* GetDescriptiveName() override
+		{
+			return InnerMalloc->GetDescriptiveName();
+		}
+
+		virtual void OnMallocInitialized() override
+		{
+			InnerMalloc->OnMallocInitialized();
+		}
+
+		virtual void OnPreFork() override
+		{
+			InnerMalloc->OnPreFork();
+		}
+
+		virtual void OnPostFork() override
+		{
+			InnerMalloc->OnPostFork();
+		}
+
+		FMalloc* GetInnerMalloc() const
+		{
+			return InnerMalloc;
+		}
+
+	private:
+		FMalloc* InnerMalloc;
+	};
+
+	// Static, so it isn't allocated by the allocator it wraps
+	TOptional<FCountingMalloc> CountingMalloc;
+}
+
+bool FThreadAllocationCounter::IsEnabled()
+{
+	return ThreadAllocationCounter::bIsEnabled.load(std::memory_order_relaxed);
+}
+
+void FThreadAllocationCounter::Install()
+{
+#if !UE_BUILD_SHIPPING
+	using namespace ThreadAllocationCounter;
+	if (!FParse::Param(FCommandLine::Get(), TEXT("MIDIGenCountAllocations")) || CountingMalloc.IsSet())
+	{
+		return;
+	}
+
+	// Every call is forwarded to the wrapped allocator, so memory allocated before is still freed by the allocator it was allocated with
+	// Threads that already read GMalloc keep calling the wrapped allocator directly, they just aren't counted
+	CountingMalloc.Emplace(GMalloc);
+	FPlatformAtomics::InterlockedExchangePtr(reinterpret_cast<void**>(&GMalloc), &CountingMalloc.GetValue());
+	bIsEnabled.store(true);
+	UE_LOG(LogTemp, Display, TEXT("Counting allocations of each thread"));
+#endif
+}
+
+void FThreadAllocationCounter::Uninstall()
+{
+	using namespace ThreadAllocationCounter;
+	if (!CountingMalloc.IsSet())
+	{
+		return;
+	}
+
+	// Only if nothing wrapped the proxy since
+	FPlatformAtomics::InterlockedCompareExchangePointer(reinterpret_cast<void**>(&GMalloc), CountingMalloc->GetInnerMalloc(), &CountingMalloc.GetValue());
+	bIsEnabled.store(false);
+}
+
+uint32 FThreadAllocationCounter::GetNbAllocations()
+{
+	return ThreadAllocationCounter::NbAllocations;
+}
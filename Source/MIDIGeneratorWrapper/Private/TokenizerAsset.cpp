@@ -3,12 +3,140 @@
 
 #include "TokenizerAsset.h"
 #include "GenThread.h"
+#include "TokenizerRegistry.h"
+#include "Serialization/CustomVersion.h"
+
+struct FTokenizerAssetCustomVersion
+{
+	enum Type
+	{
+		BeforeCustomVersionWasAdded = 0,
+		AddedCookedTables,
+		SizePrefixedCookedTables,
+
+		VersionPlusOne,
+		LatestVersion = VersionPlusOne - 1
+	};
+
+	static const FGuid GUID;
+};
+
+const FGuid FTokenizerAssetCustomVersion::GUID(0x5A3D1E27, 0x8C1B4F60, 0x9E2A7D41, 0xB3C6F815);
+static FCustomVersionRegistration GRegisterTokenizerAssetCustomVersion(FTokenizerAssetCustomVersion::GUID, FTokenizerAssetCustomVersion::LatestVersion, TEXT("TokenizerAssetVer"));
+
+FTokenizerProxy::FTokenizerProxy(MidiTokenizerHandle InTokenizer)
+	: Tokenizer(MakeShared<const FTokenizer, ESPMode::ThreadSafe>(InTokenizer))
+{
+}
+
+FTokenizerProxy::FTokenizerProxy(UTokenizerAsset* InTokenizer)
+	: Tokenizer(InTokenizer ? InTokenizer->GetSharedTokenizer() : MakeShared<const FTokenizer, ESPMode::ThreadSafe>())
+{
+}
+
+FTokenizerProxy::FTokenizerProxy(const FTokenizerPtr& InTokenizer)
+	: Tokenizer(InTokenizer.IsValid() ? InTokenizer : MakeShared<const FTokenizer, ESPMode::ThreadSafe>())
+{
+}
+
+FTokenizer::FTokenizer(MidiTokenizerHandle InTokenizer, const TSharedPtr<const FTokenizerTables>& InTables)
+	: Tokenizer(InTokenizer)
+	, Tables(InTables)
+{
+	if (Tokenizer != nullptr && !Tables.IsValid())
+	{
+		TSharedPtr<FTokenizerTables> NewTables = MakeShared<FTokenizerTables>();
+		NewTables->Build(Tokenizer, FMD5Hash());
+		Tables = NewTables;
+	}
+	BuildLookupTables();
+}
+
+FTokenizer::~FTokenizer()
+{
+	if (Tokenizer != nullptr)
+	{
+		destroyMidiTokenizer(Tokenizer);
+		Tokenizer = nullptr;
+	}
+}
 
 bool FTokenizer::Load(const FString& TokenizerPath)
 {
 	FString FullPath = FGenThread::RelativeToAbsoluteContentPath(TokenizerPath);
-	Tokenizer = createMidiTokenizer(TCHAR_TO_UTF8(*FullPath));
-	return (Tokenizer == nullptr);
+	MidiTokenizerHandle NewTokenizer = createMidiTokenizer(TCHAR_TO_UTF8(*FullPath));
+	if (NewTokenizer == nullptr)
+	{
+		return false;
+	}
+
+	if (Tokenizer != nullptr)
+	{
+		destroyMidiTokenizer(Tokenizer);
+	}
+	Tokenizer = NewTokenizer;
+
+	TSharedPtr<FTokenizerTables> NewTables = MakeShared<FTokenizerTables>();
+	NewTables->Build(Tokenizer, FTokenizerTables::HashFile(FullPath));
+	Tables = NewTables;
+	BuildLookupTables();
+	return true;
+}
+
+void FTokenizer::BuildLookupTables()
+{
+	for (TArray<uint64>& Bits : ClassBits)
+	{
+		Bits.Reset();
+	}
+	for (FRangeGroupMask& ClassMask : ClassMasks)
+	{
+		ClassMask = FRangeGroupMask();
+	}
+	DecodeOffsets = nullptr;
+	DecodedTokens = nullptr;
+	NbEncodedTokens = 0;
+	NbDecodedTokens = 0;
+
+	if (!Tables.IsValid() || !Tables->IsValid())
+	{
+		return;
+	}
+
+	NbEncodedTokens = Tables->NbEncodedTokens;
+	NbDecodedTokens = Tables->NbDecodedTokens;
+	bUseVelocities = Tables->bUseVelocities;
+	bUseDuration = Tables->bUseDuration;
+	bUseTimeSignatures = Tables->bUseTimeSignatures;
+	DecodeOffsets = Tables->DecodeOffsets.GetData();
+	DecodedTokens = Tables->DecodedTokens.GetData();
+
+	const int32 NbWords = FMath::DivideAndRoundUp(NbDecodedTokens, 64);
+	for (TArray<uint64>& Bits : ClassBits)
+	{
+		Bits.SetNumZeroed(NbWords);
+	}
+	for (int32 ClassIndex = 0; ClassIndex < int32(ETokenClass::Count); ClassIndex++)
+	{
+		TArray<FLogitsKernel::FSpan> Spans;
+		for (const FTokenRange& TokenRange : Tables->EncodedClassRanges[ClassIndex])
+		{
+			Spans.Add(FLogitsKernel::FSpan{ TokenRange.Begin, TokenRange.Size });
+		}
+		ClassMasks[ClassIndex] = FRangeGroupMask::FromSpans(Spans, NbEncodedTokens);
+	}
+
+	for (int32 DecodedToken = 0; DecodedToken < NbDecodedTokens; DecodedToken++)
+	{
+		const uint8 Classes = Tables->DecodedTokenClasses[DecodedToken];
+		for (int32 ClassIndex = 0; ClassIndex < int32(ETokenClass::Count); ClassIndex++)
+		{
+			if (Classes & (1 << ClassIndex))
+			{
+				ClassBits[ClassIndex][DecodedToken >> 6] |= uint64(1) << (DecodedToken & 63);
+			}
+		}
+	}
 }
 
 TSharedPtr<Audio::IProxyData> UTokenizerAsset::CreateProxyData(const Audio::FProxyDataInitParams& InitParams)
@@ -16,15 +144,100 @@ TSharedPtr<Audio::IProxyData> UTokenizerAsset::CreateProxyData(const Audio::FPro
 	return MakeShared<FTokenizerProxy, ESPMode::ThreadSafe>(this);
 }
 
+void UTokenizerAsset::Serialize(FArchive& Ar)
+{
+	Super::Serialize(Ar);
+
+	Ar.UsingCustomVersion(FTokenizerAssetCustomVersion::GUID);
+	if (Ar.CustomVer(FTokenizerAssetCustomVersion::GUID) < FTokenizerAssetCustomVersion::AddedCookedTables)
+	{
+		return;
+	}
+
+#if WITH_EDITOR
+	if (Ar.IsSaving() && Ar.IsPersistent())
+	{
+		CookTables();
+	}
+#endif
+
+	bool bHasCookedTables = CookedTables.IsValid();
+	Ar << bHasCookedTables;
+	if (bHasCookedTables)
+	{
+		if (Ar.IsLoading())
+		{
+			CookedTables = MakeShared<FTokenizerTables>();
+		}
+
+		bool bAreTablesLoaded = true;
+		if (Ar.CustomVer(FTokenizerAssetCustomVersion::GUID) < FTokenizerAssetCustomVersion::SizePrefixedCookedTables)
+		{
+			bAreTablesLoaded = CookedTables->SerializeUnsized(Ar);
+			if (!bAreTablesLoaded)
+			{
+				// Nothing tells how much to skip
+				Ar.SetError();
+			}
+		}
+		else
+		{
+			bAreTablesLoaded = CookedTables->Serialize(Ar);
+		}
+
+		if (!bAreTablesLoaded)
+		{
+			CookedTables.Reset();
+		}
+	}
+}
+
+#if WITH_EDITOR
+void UTokenizerAsset::CookTables()
+{
+	if (TokenizerPath.IsEmpty())
+	{
+		return;
+	}
+
+	const FString FullPath = FGenThread::RelativeToAbsoluteContentPath(TokenizerPath);
+	const FMD5Hash SourceHash = FTokenizerTables::HashFile(FullPath);
+	if (!SourceHash.IsValid() || (CookedTables.IsValid() && CookedTables->SourceHash == SourceHash))
+	{
+		return;
+	}
+
+	FTokenizerPtr Tok = FTokenizerRegistry::Get().FindOrLoad(FullPath);
+	if (Tok.IsValid() && Tok->GetTables().IsValid() && Tok->GetTables()->SourceHash == SourceHash)
+	{
+		CookedTables = MakeShared<FTokenizerTables>(*Tok->GetTables());
+	}
+}
+#endif
+
 void UTokenizerAsset::TryLoadTokenizer()
 {
 	if (!TokenizerPath.IsEmpty())
 	{
 		FString FullPath = FGenThread::RelativeToAbsoluteContentPath(TokenizerPath);
-		MidiTokenizerHandle Tok = createMidiTokenizer(TCHAR_TO_UTF8(*FullPath));
-		if (Tok)
+		FTokenizerPtr Tok = FTokenizerRegistry::Get().FindOrLoad(FullPath, CookedTables);
+		if (Tok.IsValid())
 		{
-			Tokenizer = MakeShared<FTokenizerProxy>(Tok);
+			Tokenizer = MakeShared<FTokenizerProxy, ESPMode::ThreadSafe>(Tok);
 		}
 	}
-}
\ No newline at end of file
+}
+
+FTokenizerPtr UTokenizerAsset::GetSharedTokenizer()
+{
+	if (Tokenizer == nullptr)
+	{
+		TryLoadTokenizer();
+	}
+
+	if (!Tokenizer.IsValid())
+	{
+		return MakeShared<const FTokenizer, ESPMode::ThreadSafe>();
+	}
+	return Tokenizer->GetTokenizer();
+}
@@ -0,0 +1,111 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "TokenizerRegistry.h"
+#include "HAL/FileManager.h"
+
+FTokenizerRegistry& FTokenizerRegistry::Get()
+{
+	static FTokenizerRegistry Registry;
+	return Registry;
+}
+
+FTokenizerPtr FTokenizerRegistry::FindOrLoad(const FString& AbsoluteTokenizerPath, const TSharedPtr<const FTokenizerTables>& CookedTables)
+{
+	// Cooked data can't change after cooking, the hash computed then is trusted instead of reading the file twice
+	const bool bAreCookedTablesTrusted = FPlatformProperties::RequiresCookedData()
+		&& CookedTables.IsValid() && CookedTables->IsValid() && CookedTables->SourceHash.IsValid();
+	const FMD5Hash SourceHash = bAreCookedTablesTrusted ? CookedTables->SourceHash : HashFile(AbsoluteTokenizerPath);
+	if (!SourceHash.IsValid())
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't read tokenizer %s"), *AbsoluteTokenizerPath);
+		return nullptr;
+	}
+	const FString Key = LexToString(SourceHash);
+
+	// Loading is done while holding the lock,
+	// so two assets asking for the same tokenizer at the same time don't load it twice
+	Mutex.Lock();
+
+	if (TWeakPtr<const FTokenizer, ESPMode::ThreadSafe>* WeakTokenizer = Tokenizers.Find(Key))
+	{
+		if (FTokenizerPtr Tokenizer = WeakTokenizer->Pin())
+		{
+			Mutex.Unlock();
+			return Tokenizer;
+		}
+	}
+
+	// The library can only build a tokenizer from its JSON file, the cooked tables only save building the tables
+	MidiTokenizerHandle Tok = createMidiTokenizer(TCHAR_TO_UTF8(*AbsoluteTokenizerPath));
+	if (Tok == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Couldn't load tokenizer %s"), *AbsoluteTokenizerPath);
+		Mutex.Unlock();
+		return nullptr;
+	}
+
+	TSharedPtr<const FTokenizerTables> Tables = CookedTables;
+	if (!Tables.IsValid() || !Tables->IsValid() || Tables->SourceHash != SourceHash)
+	{
+		TSharedPtr<FTokenizerTables> NewTables = MakeShared<FTokenizerTables>();
+		NewTables->Build(Tok, SourceHash);
+		Tables = NewTables;
+	}
+
+	FTokenizerPtr Tokenizer = MakeShared<const FTokenizer, ESPMode::ThreadSafe>(Tok, Tables);
+	Tokenizers.Add(Key, Tokenizer);
+
+	Mutex.Unlock();
+	return Tokenizer;
+}
+
+FMD5Hash FTokenizerRegistry::HashFile(const FString& AbsoluteTokenizerPath)
+{
+	const FFileStatData StatData = IFileManager::Get().GetStatData(*AbsoluteTokenizerPath);
+	if (!StatData.bIsValid)
+	{
+		return FMD5Hash();
+	}
+
+	// The file is only hashed again if it changed since the last time
+	Mutex.Lock();
+	if (const FHashedFile* HashedFile = HashedFiles.Find(AbsoluteTokenizerPath))
+	{
+		if (HashedFile->ModificationTime == StatData.ModificationTime && HashedFile->FileSize == StatData.FileSize)
+		{
+			const FMD5Hash Hash = HashedFile->Hash;
+			Mutex.Unlock();
+			return Hash;
+		}
+	}
+	Mutex.Unlock();
+
+	const FMD5Hash Hash = FTokenizerTables::HashFile(AbsoluteTokenizerPath);
+	if (Hash.IsValid())
+	{
+		Mutex.Lock();
+		HashedFiles.Add(AbsoluteTokenizerPath, FHashedFile{ StatData.ModificationTime, StatData.FileSize, Hash });
+		Mutex.Unlock();
+	}
+	return Hash;
+}
+
+int32 FTokenizerRegistry::GetNbLoadedTokenizers()
+{
+	Mutex.Lock();
+	int32 NbLoadedTokenizers = 0;
+	for (auto It = Tokenizers.CreateIterator(); It; ++It)
+	{
+		if (It.Value().IsValid())
+		{
+			NbLoadedTokenizers++;
+		}
+		else
+		{
+			It.RemoveCurrent();
+		}
+	}
+	Mutex.Unlock();
+	return NbLoadedTokenizers;
+}
@@ -0,0 +1,250 @@
+// Copyright Prog'z. All Rights Reserved.
+
+
+#include "TokenizerTables.h"
+#include "range.h"
+#include "Serialization/MemoryWriter.h"
+
+namespace TokenizerTables
+{
+	// "MGTT"
+	static constexpr uint32 Magic = 0x4D475454;
+	static constexpr int32 Version = 1;
+}
+
+bool FTokenizerTables::Build(MidiTokenizerHandle Tokenizer, const FMD5Hash& InSourceHash)
+{
+	if (Tokenizer == nullptr)
+	{
+		return false;
+	}
+
+	SourceHash = InSourceHash;
+	NbEncodedTokens = tokenizer_getNbEncodedTokens(Tokenizer);
+	NbDecodedTokens = tokenizer_getNbDecodedTokens(Tokenizer);
+	bUseVelocities = tokenizer_useVelocities(Tokenizer);
+	bUseDuration = tokenizer_useDuration(Tokenizer);
+	bUseTimeSignatures = tokenizer_useTimeSignatures(Tokenizer);
+	TokenizationType = ANSI_TO_TCHAR(tokenizer_getTokenizationType(Tokenizer));
+
+	DecodeOffsets.Reset(NbEncodedTokens + 1);
+	DecodedTokens.Reset(NbEncodedTokens);
+	for (int32 EncodedToken = 0; EncodedToken < NbEncodedTokens; EncodedToken++)
+	{
+		const int32_t* DecodedBegin;
+		const int32_t* DecodedEnd;
+		tokenizer_decodeTokenFast(Tokenizer, EncodedToken, &DecodedBegin, &DecodedEnd);
+
+		DecodeOffsets.Add(DecodedTokens.Num());
+		DecodedTokens.Append(DecodedBegin, int32(DecodedEnd - DecodedBegin));
+	}
+	DecodeOffsets.Add(DecodedTokens.Num());
+
+	DecodedTokenClasses.SetNumZeroed(NbDecodedTokens);
+	DecodedTokenStringOffsets.Reset(NbDecodedTokens);
+	DecodedTokenStrings.Reset();
+	for (int32 DecodedToken = 0; DecodedToken < NbDecodedTokens; DecodedToken++)
+	{
+		uint8& Classes = DecodedTokenClasses[DecodedToken];
+		Classes |= isPitch(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::Pitch)) : 0;
+		Classes |= isVelocity(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::Velocity)) : 0;
+		Classes |= isDuration(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::Duration)) : 0;
+		Classes |= isTimeShift(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::TimeShift)) : 0;
+		Classes |= isPosition(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::Position)) : 0;
+		Classes |= isBarNone(Tokenizer, DecodedToken) ? (1 << int32(ETokenClass::BarNone)) : 0;
+
+		DecodedTokenStringOffsets.Add(DecodedTokenStrings.Num());
+		const char* String = tokenizer_decodedTokenToString(Tokenizer, DecodedToken);
+		if (String != nullptr)
+		{
+			DecodedTokenStrings.Append(String, FCStringAnsi::Strlen(String));
+		}
+		DecodedTokenStrings.Add('\0');
+	}
+
+	using FAddTokensStartingBy = void(*)(MidiTokenizerHandle, RangeGroupHandle);
+	const FAddTokensStartingBy AddTokensStartingBy[int32(ETokenClass::Count)] =
+	{
+		&tokenizer_addTokensStartingByPitch,
+		&tokenizer_addTokensStartingByVelocity,
+		&tokenizer_addTokensStartingByDuration,
+		&tokenizer_addTokensStartingByTimeShift,
+		&tokenizer_addTokensStartingByPosition,
+		&tokenizer_addTokensStartingByBarNone,
+	};
+	for (int32 ClassIndex = 0; ClassIndex < int32(ETokenClass::Count); ClassIndex++)
+	{
+		RangeGroupHandle RangeGroup = createRangeGroup();
+		AddTokensStartingBy[ClassIndex](Tokenizer, RangeGroup);
+		rangeGroupUpdateCache(RangeGroup);
+
+		const Range* Ranges;
+		size_t NbRanges;
+		rangeGroupGetRanges(RangeGroup, &Ranges, &NbRanges);
+		EncodedClassRanges[ClassIndex].Reset(int32(NbRanges));
+		for (size_t r = 0; r < NbRanges; r++)
+		{
+			EncodedClassRanges[ClassIndex].Add(FTokenRange{ Ranges[r].min, int32(rangeSize(&Ranges[r])) });
+		}
+		destroyRangeGroup(RangeGroup);
+	}
+
+	return true;
+}
+
+bool FTokenizerTables::Serialize(FArchive& Ar)
+{
+	// Size-prefixed, so tables written by another version are skipped without desyncing the archive
+	if (!Ar.IsLoading())
+	{
+		TArray<uint8> Blob;
+		FMemoryWriter Writer(Blob);
+		SerializeUnsized(Writer);
+		int64 BlobSize = Blob.Num();
+		Ar << BlobSize;
+		Ar.Serialize(Blob.GetData(), BlobSize);
+		return true;
+	}
+
+	int64 BlobSize = 0;
+	Ar << BlobSize;
+	const int64 BlobEnd = Ar.Tell() + BlobSize;
+	if (Ar.IsError() || BlobSize < 0)
+	{
+		NbEncodedTokens = 0;
+		return false;
+	}
+
+	if (!SerializeUnsized(Ar) || Ar.Tell() != BlobEnd)
+	{
+		// They are built again from the JSON file
+		NbEncodedTokens = 0;
+		Ar.Seek(BlobEnd);
+		return false;
+	}
+	return true;
+}
+
+bool FTokenizerTables::SerializeUnsized(FArchive& Ar)
+{
+	uint32 Magic = TokenizerTables::Magic;
+	int32 Version = TokenizerTables::Version;
+	Ar << Magic;
+	Ar << Version;
+	if (Ar.IsLoading() && (Magic != TokenizerTables::Magic || Version != TokenizerTables::Version))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Tokenizer tables version %d can't be loaded, they have to be cooked again"), Version);
+		NbEncodedTokens = 0;
+		return false;
+	}
+
+	Ar << SourceHash;
+	Ar << NbEncodedTokens;
+	Ar << NbDecodedTokens;
+	Ar << bUseVelocities;
+	Ar << bUseDuration;
+	Ar << bUseTimeSignatures;
+	Ar << TokenizationType;
+
+	// Plain arrays are read with a single copy
+	DecodeOffsets.BulkSerialize(Ar);
+	DecodedTokens.BulkSerialize(Ar);
+	DecodedTokenClasses.BulkSerialize(Ar);
+	DecodedTokenStrings.BulkSerialize(Ar);
+	DecodedTokenStringOffsets.BulkSerialize(Ar);
+	for (TArray<FTokenRange>& ClassRanges : EncodedClassRanges)
+	{
+		ClassRanges.BulkSerialize(Ar);
+	}
+
+	if (Ar.IsLoading() && (Ar.IsError() || DecodeOffsets.Num() != NbEncodedTokens + 1 || DecodedTokenClasses.Num() != NbDecodedTokens))
+	{
+		NbEncodedTokens = 0;
+		return false;
+	}
+	return true;
+}
+
+SIZE_T FTokenizerTables::GetAllocatedSize() const
+{
+	SIZE_T Size = DecodeOffsets.GetAllocatedSize() + DecodedTokens.GetAllocatedSize() + DecodedTokenClasses.GetAllocatedSize()
+		+ DecodedTokenStrings.GetAllocatedSize() + DecodedTokenStringOffsets.GetAllocatedSize();
+	for (const TArray<FTokenRange>& ClassRanges : EncodedClassRanges)
+	{
+		Size += ClassRanges.GetAllocatedSize();
+	}
+	return Size;
+}
+
+FMD5Hash FTokenizerTables::HashFile(const FString& FilePath)
+{
+	return FMD5Hash::HashFile(*FilePath);
+}
+
+#if !UE_BUILD_SHIPPING
+#include "HAL/IConsoleManager.h"
+#include "Serialization/MemoryReader.h"
+#include "TokenizerRegistry.h"
+#include "GenThread.h"
+
+namespace TokenizerLoadBenchmark
+{
+	// Usage : MIDIGen.Bench.TokenizerLoad TokenizerPath [NbIterations]
+	// Times FTokenizerRegistry::FindOrLoad() as assets call it, with and without cooked tables
+	void Run(const TArray<FString>& Args)
+	{
+		if (Args.Num() < 1)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Usage : MIDIGen.Bench.TokenizerLoad TokenizerPath [NbIterations]"));
+			return;
+		}
+
+		const FString JsonPath = FGenThread::RelativeToAbsoluteContentPath(Args[0]);
+		const int32 NbIterations = Args.Num() > 1 ? FMath::Max(1, FCString::Atoi(*Args[1])) : 5;
+
+		// A tokenizer still used by something would be returned by the registry without being loaded
+		UE_CLOG(FTokenizerRegistry::Get().GetNbLoadedTokenizers() > 0, LogTemp, Warning,
+			TEXT("Tokenizers are already loaded, if one of them is this one the timings are cache hits"));
+
+		FTokenizerPtr Tokenizer = FTokenizerRegistry::Get().FindOrLoad(JsonPath);
+		if (!Tokenizer.IsValid())
+		{
+			UE_LOG(LogTemp, Error, TEXT("Couldn't load the tokenizer %s"), *JsonPath);
+			return;
+		}
+
+		// Same blob as the one cooked with the asset
+		TArray<uint8> Blob;
+		FMemoryWriter Writer(Blob);
+		FTokenizerTables(*Tokenizer->GetTables()).Serialize(Writer);
+		Tokenizer.Reset();
+
+		double StartTime = FPlatformTime::Seconds();
+		for (int32 Iteration = 0; Iteration < NbIterations; Iteration++)
+		{
+			FTokenizerPtr LoadedTokenizer = FTokenizerRegistry::Get().FindOrLoad(JsonPath);
+			check(LoadedTokenizer.IsValid());
+		}
+		const double JsonMs = (FPlatformTime::Seconds() - StartTime) * 1000.0 / NbIterations;
+
+		StartTime = FPlatformTime::Seconds();
+		for (int32 Iteration = 0; Iteration < NbIterations; Iteration++)
+		{
+			FMemoryReader Reader(Blob);
+			TSharedPtr<FTokenizerTables> CookedTables = MakeShared<FTokenizerTables>();
+			CookedTables->Serialize(Reader);
+			FTokenizerPtr LoadedTokenizer = FTokenizerRegistry::Get().FindOrLoad(JsonPath, CookedTables);
+			check(LoadedTokenizer.IsValid());
+		}
+		const double CookedMs = (FPlatformTime::Seconds() - StartTime) * 1000.0 / NbIterations;
+
+		UE_LOG(LogTemp, Display, TEXT("Tokenizer FindOrLoad | Without cooked tables: %8.2f ms | With cooked tables (%.1f KB): %8.2f ms"),
+			JsonMs, Blob.Num() / 1024.0, CookedMs);
+	}
+
+	FAutoConsoleCommand Command(
+		TEXT("MIDIGen.Bench.TokenizerLoad"),
+		TEXT("Cost of FTokenizerRegistry::FindOrLoad(), with and without the tables cooked with the asset."),
+		FConsoleCommandWithArgsDelegate::CreateStatic(&Run));
+}
+#endif
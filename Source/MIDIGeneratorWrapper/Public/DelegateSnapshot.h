@@ -0,0 +1,48 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+/**
+ * Multicast delegate read by a hot thread without locking.
+ * Each subscription publishes a new immutable copy of the delegate with an atomic pointer swap.
+ * Previous copies may still be broadcast by a reader, so they're only freed with the owner.
+ * Subscriptions are expected to be rare (set up when starting a generation).
+ */
+template<typename DelegateType>
+class TDelegateSnapshot
+{
+public:
+	TDelegateSnapshot()
+	{
+		Snapshots.Add(MakeUnique<DelegateType>());
+		Current.store(Snapshots.Last().Get(), std::memory_order_release);
+	}
+
+	TDelegateSnapshot(const TDelegateSnapshot&) = delete;
+	TDelegateSnapshot& operator=(const TDelegateSnapshot&) = delete;
+
+	template<typename FunctorType>
+	void AddLambda(FunctorType&& Functor)
+	{
+		WriteMutex.Lock();
+		TUniquePtr<DelegateType> Next = MakeUnique<DelegateType>(*Snapshots.Last());
+		Next->AddLambda(Forward<FunctorType>(Functor));
+		Current.store(Next.Get(), std::memory_order_release);
+		Snapshots.Add(MoveTemp(Next));
+		WriteMutex.Unlock();
+	}
+
+	// The returned delegate is never modified
+	const DelegateType& Get() const
+	{
+		return *Current.load(std::memory_order_acquire);
+	}
+
+private:
+	FCriticalSection WriteMutex;
+	TArray<TUniquePtr<DelegateType>> Snapshots;
+	std::atomic<const DelegateType*> Current = nullptr;
+};
@@ -6,15 +6,84 @@
 #include "MIDIGenerator.h"
 #include "TokenizerAsset.h"
 #include "BeatGenerator.h"
+#include "note.h"
 #include "fwd.h"
+#include "SPSCRing.h"
+#include "MIDIModelPool.h"
+#include "DelegateSnapshot.h"
+#include "LookaheadScheduler.h"
 
 DECLARE_CYCLE_STAT(TEXT("GenThread"), STAT_GenThread, STATGROUP_Game);
-
-DECLARE_MULTICAST_DELEGATE_OneParam(FOnGenerated, int32 newToken);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("GenThread::TokenRingOverruns"), STAT_GenThread_TokenRingOverruns, STATGROUP_Game);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("GenThread::NoteRingOverruns"), STAT_GenThread_NoteRingOverruns, STATGROUP_Game);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GenThread::NbReplayedTokens"), STAT_GenThread_NbReplayedTokens, STATGROUP_Game);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("GenThread::NbContextRebases"), STAT_GenThread_NbContextRebases, STATGROUP_Game);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GenThread::TokenMs"), STAT_GenThread_TokenMs, STATGROUP_Game);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("GenThread::WorstTokenMs"), STAT_GenThread_WorstTokenMs, STATGROUP_Game);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("GenThread::WorstPrefillTokenMs"), STAT_GenThread_WorstPrefillTokenMs, STATGROUP_Game);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GenThread::NbTokenAllocations"), STAT_GenThread_NbTokenAllocations, STATGROUP_Game);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("GenThread::NbSteadyStateAllocations"), STAT_GenThread_NbSteadyStateAllocations, STATGROUP_Game);
+DECLARE_DWORD_COUNTER_STAT(TEXT("GenThread::State"), STAT_GenThread_State, STATGROUP_Game);
+
+class AutoRegressivePipelineObserver;
+
+DECLARE_MULTICAST_DELEGATE_TwoParams(FOnGenerated, int32 batchIndex, int32 newToken);
 DECLARE_MULTICAST_DELEGATE_OneParam(FOnSearch, const struct SearchArgs& args);
 DECLARE_MULTICAST_DELEGATE(FOnInit);
 DECLARE_MULTICAST_DELEGATE_OneParam(FOnCacheRemoved, int32 libTick);
 
+enum class EGenThreadState : uint8
+{
+	// Blocked until the tokenizer is loaded and a search strategy is set
+	WaitingForSetup,
+	Generating,
+	// Blocked while far enough ahead of the playhead
+	Paused,
+};
+
+// Token published by the gen thread to the audio thread
+struct FGeneratedToken
+{
+	int32 BatchIndex = 0;
+	int32 Token = 0;
+};
+
+// Note published by the gen thread to the audio thread
+struct FGeneratedNote
+{
+	Note GenNote;
+	int32 BatchIndex = 0;
+	// Rewind epoch when the note was published, see FGenThread::GetLastRewind()
+	uint32 Epoch = 0;
+};
+
+// Position in the generated sequence another batch can be forked from, see FGenThread::ForkBatch()
+struct FGenCheckpoint
+{
+	// Generation history tick
+	int32 Tick = 0;
+	// Number of tokens in FGenBatch::EncodedTokens at that tick
+	int32 NbTokens = 0;
+};
+
+// A sequence generated in parallel with the others, in the same forward pass
+struct FGenBatch
+{
+	AutoRegressiveBatchHandle Handle = 0;
+	TArray<int32> EncodedTokens;
+	// Tokens set before the generation history was created, they aren't part of it
+	int32 NbSeedTokens = 0;
+	BeatGeneratorHandle BeatGenerator = nullptr;
+
+	// Sorted by tick
+	TArray<FGenCheckpoint> Checkpoints;
+
+	// Index of the next history note to push into GeneratedNotes, only used by the gen thread
+	int32 NextNoteIndexToPublish = 0;
+	// Index in EncodedTokens of the next token to push into GeneratedTokens, only used by the gen thread
+	int32 NextTokenIndexToPublish = 0;
+};
+
 //class FGenThread;
 //class FMIDIGeneratorProxy;
 //using FMIDIGeneratorProxyPtr = TSharedPtr<FMIDIGeneratorProxy, ESPMode::ThreadSafe>;
@@ -48,9 +117,15 @@ class MIDIGENERATORWRAPPER_API FGenThread : public FRunnable//, public IAudioPro
 {
 public:
 	//FGenThread(const FString& TokenizerPath, const FString& ModelPath);
-	void SetPipeline(IAutoRegressivePipeline* NewPipeline);
+	// The pipeline goes back to its model when the thread is destroyed
+	void SetPipeline(const FMIDIPipelinePtr& NewPipeline);
 	IAutoRegressivePipeline* GetPipeline() const { return Pipeline; }
-	AutoRegressiveBatchHandle GetBatch() const { return Batch2; }
+	AutoRegressiveBatchHandle GetBatch(int32 BatchIndex = 0) const { return GenBatches[BatchIndex].Handle; }
+	BeatGeneratorHandle GetBeatGenerator(int32 BatchIndex = 0) const { return GenBatches[BatchIndex].BeatGenerator; }
+
+	// Must be called before Start(), every batch is generated by the same forward pass
+	void SetNbBatches(int32 InNbBatches);
+	int32 GetNbBatches() const { return NbBatches; }
 	void PreStart(const FString& TokenizerPath, const FString& ModelPath, const TArray<int32>& InTokens);
 	void Start(const FString& TokenizerPath, const FString& ModelPath, const TArray<int32>& InTokens);
 	void Start();
@@ -66,25 +141,21 @@ public:
 	//	return Tokenizer->GetTokenizer()->Tokenizer;
 	//}
 
-	void SetTok(const FTokenizerProxyPtr& InTokenizer)
-	{
-		Tokenizer = InTokenizer;
-	}
+	// Can be called from any thread, before or after Start()
+	void SetTok(const FTokenizerProxyPtr& InTokenizer);
 
-	const FTokenizer& GetTok() const
-	{
-		return *Tokenizer->GetTokenizer();
-	}
+	// Empty until a tokenizer is set, the returned tokenizer stays valid as long as the thread
+	const FTokenizer& GetTok() const;
 
 	MusicGeneratorHandle GetGen() const
 	{
 		return generator;
 	}
 
-	void GetEncodedTokens(TArray<int32>& OutEncodedTokens)
+	void GetEncodedTokens(TArray<int32>& OutEncodedTokens, int32 BatchIndex = 0)
 	{
 		Mutex.Lock();
-		OutEncodedTokens = EncodedTokens;
+		OutEncodedTokens = GenBatches.IsValidIndex(BatchIndex) ? GenBatches[BatchIndex].EncodedTokens : EncodedTokens;
 		Mutex.Unlock();
 	}
 
@@ -92,14 +163,33 @@ public:
 
 	//void SetSearchStrategy(void* SearchStrategyData, TSearchStrategy SearchStrategy);
 	void SetSearchStrategy(TFunction<void(const struct SearchArgs& args)> InOnSearch);
-	void SetOnGenerated(TFunction<void(int32 NewToken)> InOnGenerated);
+	void SetOnGenerated(TFunction<void(int32 BatchIndex, int32 NewToken)> InOnGenerated);
 	void AddOnInit(TFunction<void()> InOnInit);
+	// Must be called once the pipeline is set, the observer is removed from it before the pipeline is released
+	void AddObserver(const TSharedPtr<AutoRegressivePipelineObserver>& Observer);
+	// Must be called before Start(), the decoder is then given the new notes instead of GeneratedNotes
+	// It's called from the gen thread and returns how many of the notes it consumed, the other ones are given again next time
+	void SetNoteDecoder(TFunction<int32(int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch)> InNoteDecoder);
+	// Must be called before Start(), called by the gen thread before each token
+	// Changes to what the batches are generated with are made there, so they don't race with the generation
+	void SetOnBeforeToken(TFunction<void()> InOnBeforeToken);
 
 	// BEGIN FRunnable 
 	virtual void Stop() override;
 	// END FRunnable
 
-	void RemoveCacheAfterTick(int32 GenLibTick, float Ms = -1.0);
+	// Can be called from the game and the audio threads, the gen thread rewinds every batch to GenLibTick before its next token
+	void RemoveCacheAfterTick(int32 GenLibTick);
+
+	// Gen thread, replaces the batch with the source batch up to its last checkpoint at or before MaxTick
+	// Only the tokens since the lines diverged are fed again, OutRewindTick is the tick the batch was rewound to
+	// Returns false if the batch already continues the source from there, or if they diverged before the context window
+	bool ForkBatch(int32 BatchIndex, int32 SourceBatchIndex, int32 MaxTick, int32& OutRewindTick);
+
+	EGenThreadState GetState() const { return State.load(std::memory_order_relaxed); }
+
+	// Never pauses, whatever the lookahead, for benchmarks without a playhead
+	void SetFreeRunning(bool bInIsFreeRunning) { bIsFreeRunning = bInIsFreeRunning; }
 
 protected:
 	// BEGIN FRunnable 
@@ -109,30 +199,62 @@ protected:
 	// END FRunnable
 
 	void RemoveCacheAfterTickInternal();
+	void PublishNewNotes(int32 BatchIndex);
+	void PublishNewTokens(int32 BatchIndex);
+	// Feeds at most NbMaxTokens of the last tokens of the batch
+	void SetContext(const FGenBatch& GenBatch, int32 NbMaxTokens);
+	// Shrinks the context of every batch to its last NbContextTokens tokens, while the thread is ahead of the playhead when possible
+	void RebaseContext(int32 NbContextTokens);
+	void RecordCheckpoint(FGenBatch& GenBatch);
+
+	// Creates the generation histories and broadcasts OnInit, once the tokenizer is loaded
+	void SetUpHistories();
+	bool IsTokenizerLoaded() const;
+	bool IsReadyToGenerate() const;
+	void SetState(EGenThreadState NewState);
+
+	// Tick of the last note generated by the batch that is the least ahead, read from the histories
+	// Returns false if a batch hasn't generated any note yet, only called by the gen thread
+	bool ComputeGeneratedUntilTick(int32& OutTick) const;
+	void PublishGeneratedUntilTick();
 
 private:
 	IAutoRegressivePipeline* Pipeline = nullptr;
+	FMIDIPipelinePtr PipelineRef;
+	TArray<TSharedPtr<AutoRegressivePipelineObserver>> Observers;
 	EnvHandle env = nullptr;
 	MusicGeneratorHandle generator = nullptr;
 
 	FString TokenizerPath; 
 	FString ModelPath;
 
-	FTokenizerProxyPtr Tokenizer;
+	// Published by SetTok(), read by the gen thread without locking
+	std::atomic<const FTokenizer*> Tokenizer = nullptr;
+	// Every tokenizer published so far, a reader may still use a previous one
+	TArray<FTokenizerPtr> TokenizerRefs;
+	FCriticalSection TokenizerMutex;
+	// Only used by the gen thread
+	bool bHasHistories = false;
 
 	//void* SearchStrategyData = nullptr;
 	//TSearchStrategy SearchStrategy = nullptr;
-	FOnSearch OnSearch;
-	FOnGenerated OnGenerated;
-	FOnInit OnInit;
-
-	// OnGenerated mutex
+	// Broadcast by the gen thread without locking
+	TDelegateSnapshot<FOnSearch> OnSearch;
+	TDelegateSnapshot<FOnGenerated> OnGenerated;
+	TDelegateSnapshot<FOnInit> OnInit;
+	TFunction<int32(int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch)> NoteDecoder;
+	TFunction<void()> OnBeforeToken;
+
+	// GenBatches tokens mutex
 	FCriticalSection Mutex;
 
 	RunInstanceHandle runInstance = nullptr;
 	BatchHandle batch = nullptr;
-	AutoRegressiveBatchHandle Batch2;
 
+	int32 NbBatches = 1;
+	TArray<FGenBatch> GenBatches;
+
+	// Tokens every batch starts from
 	TArray<int32> EncodedTokens;
 	//int32 LineNbMaxToken = 256;
 	//int32 LineNbMaxToken = 512;
@@ -140,36 +262,88 @@ private:
 
 	int32 NbBatchGen = 10;
 
-	bool forceReupdate = false;
+	// A checkpoint is recorded every NbTokensPerCheckpoint tokens, or when crossing a multiple of NbTicksPerCheckpoint
+	int32 NbTokensPerCheckpoint = 64;
+	int32 NbTicksPerCheckpoint = 16;
 
 	FRunnableThread* Thread = nullptr;
-	bool bShutdown = false;
+	std::atomic_bool bShutdown = false;
+	std::atomic<EGenThreadState> State = EGenThreadState::WaitingForSetup;
+	std::atomic_bool bIsFreeRunning = false;
 
+	// Tokens in the context of the pipeline, the same for every batch
 	int32 NbTokensSinceLastRefresh = 0;
+	// When the context has less than that many free tokens and the thread is ahead, it is rebased
+	int32 NbRebaseMarginTokens = 128;
+	// When it has less than that many free tokens, it is rebased even if a token is needed
+	int32 NbForcedRebaseMarginTokens = 16;
+	// Tokens kept in the context after a rebase
+	int32 NbContextTokensAfterRebase = 768;
+	// Tokens kept when a token is needed, the next token computes all of them
+	// The context is rebased again with NbContextTokensAfterRebase tokens the next time the thread is ahead
+	int32 NbContextTokensAfterForcedRebase = 192;
+	bool bIsContextShortened = false;
+
+	// Worst token time of the last NbTokensPerWorstTokenWindow tokens, the tokens following a prefill are measured apart
+	double WindowWorstTokenMs = 0.0;
+	double WindowWorstPrefillTokenMs = 0.0;
+	int32 NbTokensInWorstTokenWindow = 0;
+	int32 NbTokensPerWorstTokenWindow = 256;
+	// Set when tokens are fed to the pipeline, the next token computes them too
+	bool bIsPrefillPending = false;
+
+	// Allocations are only counted after the scratch buffers had the time to grow, see FThreadAllocationCounter
+	int32 NbGeneratedTokens = 0;
+	int32 NbWarmUpTokens = 64;
+	// Latency percentiles are recomputed every NbTokensPerLatencyStats tokens, see FLatencyHistograms
+	int32 NbTokensPerLatencyStats = 64;
+	// Capacity reserved for the tokens generated by each batch
+	int32 NbReservedTokens = 16384;
+	// Checkpoints recorded because of ticks, in addition to the ones recorded every NbTokensPerCheckpoint tokens
+	int32 NbReservedCheckpoints = 64;
 
 	////~Begin IAudioProxyDataFactory Interface.
 	//virtual TSharedPtr<Audio::IProxyData> CreateProxyData(const Audio::FProxyDataInitParams& InitParams) override;
 	////~ End IAudioProxyDataFactory Interface.
 
 public:
-	BeatGeneratorHandle beatGenerator = nullptr;
 	FCriticalSection BeatGeneratorMutex;
 
 	std::atomic_bool ShouldIgnoreNextToken = false;
 	std::atomic_bool ShouldRemoveTokens = false;
-	int32_t CacheTickToRemove = 0;
-	float CacheMsToRemove = 0;
 
 	FOnCacheRemoved OnCacheRemoved;
 
+	// Lock-free handoff from the gen thread (producer) to the audio render thread (consumer)
+	TSPSCRing<FGeneratedToken, 1024> GeneratedTokens;
+	TSPSCRing<FGeneratedNote, 1024> GeneratedNotes;
+
 	FEvent* Semaphore = nullptr;
 
 	std::atomic_int32_t CurrentTick;
-	//int32 NbMinTicksAhead = 50;
-	//int32 NbMaxTicksAhead = 400;
-	int32 NbMinTicksAhead = 20;
-	int32 NbMaxTicksAhead = 80;
+	// Lookahead thresholds, adapted to the throughput and the tempo
+	FLookaheadScheduler Scheduler;
+
+	// Last value published by the gen thread, can be called from any thread
+	// Returns false if a batch hasn't generated any note yet
+	bool GetGeneratedUntilTick(int32& OutTick) const;
+	// Incremented each time the gen thread publishes, even if the tick didn't change
+	uint32 GetGeneratedUntilVersion() const;
 
+	// The epoch is incremented each time a rewind is requested, both are read together
+	// Notes published with an older epoch and a tick after OutTick are stale
+	void GetLastRewind(uint32& OutEpoch, int32& OutTick) const;
+	uint32 GetRewindEpoch() const;
+
+	// Only read atomics, ShouldResumeGeneration is called by the audio thread
 	bool ShouldResumeGeneration() const;
 	bool ShouldSleep() const;
+
+private:
+	// Tick in the low 32 bits, version in the high ones, so both are read together
+	std::atomic_uint64_t GeneratedUntilSnapshot = uint32(INT_MIN);
+	// Tick of the last rewind in the low 32 bits, epoch in the high ones
+	std::atomic_uint64_t RewindSnapshot = 0;
+
+public:
 };
\ No newline at end of file
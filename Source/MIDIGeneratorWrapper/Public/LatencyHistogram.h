@@ -0,0 +1,100 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+DECLARE_STATS_GROUP(TEXT("MIDIGenLatency"), STATGROUP_MIDIGenLatency, STATCAT_Advanced);
+
+// Stages of the generation pipeline whose latency is recorded
+enum class ELatencyStage : uint8
+{
+	// Whole token, from preGenerate to postGenerate
+	Token,
+	PreGenerate,
+	Generate,
+	PostGenerate,
+	SearchStrategy,
+	NoteConversion,
+	BeatGeneration,
+	Execute,
+	Count,
+};
+
+/**
+ * Lock-free histogram of durations, with 4 buckets per power of 2 microseconds (~19% resolution).
+ * Recording is a couple of relaxed atomic increments, percentiles are the upper bound of their bucket.
+ */
+class MIDIGENERATORWRAPPER_API FLatencyHistogram
+{
+public:
+	static constexpr int32 NbBucketsPerOctave = 4;
+	static constexpr int32 NbBuckets = 128;
+
+	void Record(double Us);
+	void Reset();
+
+	uint64 GetCount() const;
+	// Percentile in [0, 1]
+	double GetPercentileUs(double Percentile) const;
+	double GetMaxUs() const;
+
+	static int32 GetBucketIndex(double Us);
+	static double GetBucketUpperBoundUs(int32 BucketIndex);
+
+private:
+	std::atomic<uint64> Buckets[NbBuckets] = {};
+	std::atomic<double> MaxUs = 0.0;
+};
+
+/**
+ * Process-wide histograms of every stage, shared by every generator.
+ * Percentiles are published as stats (stat MIDIGenLatency) and can be dumped with MIDIGen.Latency.Dump.
+ */
+class MIDIGENERATORWRAPPER_API FLatencyHistograms
+{
+public:
+	static FLatencyHistograms& Get();
+
+	void Record(ELatencyStage Stage, double Us)
+	{
+		Histograms[int32(Stage)].Record(Us);
+	}
+
+	const FLatencyHistogram& GetHistogram(ELatencyStage Stage) const
+	{
+		return Histograms[int32(Stage)];
+	}
+
+	void Reset();
+	void PublishStats() const;
+
+	FString ToCSV() const;
+	FString ToJSON() const;
+
+	static const TCHAR* GetStageName(ELatencyStage Stage);
+
+private:
+	FLatencyHistogram Histograms[int32(ELatencyStage::Count)];
+};
+
+// Records the duration of the scope
+class FScopedLatency
+{
+public:
+	explicit FScopedLatency(ELatencyStage InStage)
+		: Stage(InStage)
+		, StartCycles(FPlatformTime::Cycles64())
+	{
+	}
+
+	~FScopedLatency()
+	{
+		FLatencyHistograms::Get().Record(Stage, FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles) * 1000.0);
+	}
+
+private:
+	ELatencyStage Stage;
+	uint64 StartCycles;
+};
@@ -0,0 +1,40 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Fused top-k / top-p sampling over the logits of a range group.
+ * Does what rangeGroupWrite, sortLogits, stableSoftmax and topPSampling do in separate passes over the vocabulary,
+ * with a single vectorized pass over the allowed tokens followed by passes over the top k only.
+ * Scratch buffers are kept between calls, a kernel must only be used by one thread at a time.
+ */
+class MIDIGENERATORWRAPPER_API FLogitsKernel
+{
+public:
+	// Allowed tokens are [Begin, Begin + Size)
+	struct FSpan
+	{
+		int32 Begin = 0;
+		int32 Size = 0;
+	};
+
+	// CompactBias can be nullptr, otherwise it has one value per allowed token, in span order,
+	// added to the logits before selecting the top k
+	// RandomValue in [0, 1)
+	// Returns -1 if no token is allowed
+	int32 Sample(const float* Logits, TArrayView<const FSpan> Spans, const float* CompactBias, int32 TopK, float TopP, float RandomValue);
+
+	// Writes the logits of the allowed tokens contiguously, in span order, with their bias if any
+	static void Gather(const float* Logits, TArrayView<const FSpan> Spans, const float* CompactBias, TArray<float>& OutCompactLogits);
+	// Returns -1 if the index is past the allowed tokens
+	static int32 CompactIndexToToken(TArrayView<const FSpan> Spans, int32 CompactIndex);
+
+private:
+	// Biased logits of the allowed tokens, in span order
+	TArray<float> CompactLogits;
+
+	TArray<float> TopLogits;
+	TArray<int32> TopCompactIndices;
+};
@@ -0,0 +1,61 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GenThread::TargetLookaheadMs"), STAT_GenThread_TargetLookaheadMs, STATGROUP_Game);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GenThread::ActualLookaheadMs"), STAT_GenThread_ActualLookaheadMs, STATGROUP_Game);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GenThread::TokensPerSecond"), STAT_GenThread_TokensPerSecond, STATGROUP_Game);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("GenThread::TokensPerTick"), STAT_GenThread_TokensPerTick, STATGROUP_Game);
+
+/**
+ * Decides how many generation library ticks the gen thread stays ahead of the playhead.
+ * The lookahead is targeted in milliseconds and converted to ticks with the tempo at the playhead,
+ * then stretched when generating a tick of music takes longer than playing it.
+ * The gen thread records tokens, the audio thread sets the tempo, both read the thresholds.
+ */
+class MIDIGENERATORWRAPPER_API FLookaheadScheduler
+{
+public:
+	// Gen thread, HistoryTick is the tick of the generation history after the token
+	void RecordToken(double TokenMs, int32 HistoryTick);
+
+	// Audio thread, from the tempo map at the playhead
+	void SetMsPerTick(float InMsPerTick);
+
+	// The thread resumes under TargetLookaheadMs and sleeps again once HysteresisMs further ahead
+	void SetTargetLookahead(float InTargetLookaheadMs, float InHysteresisMs);
+
+	int32 GetResumeTicksAhead() const { return UnpackResumeTicksAhead(TicksAhead.load(std::memory_order_relaxed)); }
+	int32 GetSleepTicksAhead() const { return UnpackSleepTicksAhead(TicksAhead.load(std::memory_order_relaxed)); }
+
+	// Returns 0 while the tempo is unknown
+	float TicksToMs(int32 NbTicks) const { return NbTicks * MsPerTick.load(std::memory_order_relaxed); }
+
+private:
+	// Only reads atomics, called by the gen, audio and game threads
+	void UpdateThresholds();
+
+	static uint64 PackTicksAhead(int32 Resume, int32 Sleep) { return uint64(uint32(Resume)) | (uint64(uint32(Sleep)) << 32); }
+	static int32 UnpackResumeTicksAhead(uint64 Packed) { return int32(uint32(Packed)); }
+	static int32 UnpackSleepTicksAhead(uint64 Packed) { return int32(uint32(Packed >> 32)); }
+
+	std::atomic<float> MsPerTick = 0.0f;
+	std::atomic<float> TargetLookaheadMs = 1000.0f;
+	std::atomic<float> HysteresisMs = 3000.0f;
+	// Measured by the gen thread
+	std::atomic<float> GenerationMsPerTick = 0.0f;
+
+	// Resume and sleep thresholds, published together so they are never read from different updates
+	// Used until the tempo is known
+	std::atomic_uint64_t TicksAhead = PackTicksAhead(20, 80);
+
+	// Only used by the gen thread
+	double AverageTokenMs = 0.0;
+	double AverageTokensPerTick = 0.0;
+	int32 LastTick = INDEX_NONE;
+	int32 NbTokensSinceLastTick = 0;
+	double SmoothingFactor = 0.05;
+};
@@ -0,0 +1,25 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MIDIGeneratorBenchmarkCommandlet.generated.h"
+
+/**
+ * Runs the generation loop without audio and reports its throughput, latency and memory.
+ * The gen thread is free running, the events it builds are consumed by the commandlet instead of the audio thread.
+ *
+ * Usage : UnrealEditor-Cmd <Project> -run=MIDIGeneratorBenchmark -Model=<ModelFolder> -Tokenizer=<TokenizerJson>
+ *	[-Tokens=512] [-WarmUp=32] [-Voices=1] [-Prompt=1,2,3] [-Timeout=600] [-Output=<File.json>]
+ */
+UCLASS()
+class MIDIGENERATORWRAPPER_API UMIDIGeneratorBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UMIDIGeneratorBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
@@ -7,24 +7,29 @@
 #include "HarmonixMidi/MidiFile.h"
 #include "IAudioProxyInitializer.h"
 #include "fwd.h"
+#include "note.h"
 #include "HarmonixMetasound/DataTypes/MidiClock.h"
+#include "MidiEventStager.h"
+#include "LogitsKernel.h"
+#include "RangeGroupMask.h"
 #include "MIDIGeneratorEnv.generated.h"
 
 struct FMIDIGeneratorEnv;
 class FMIDIGeneratorProxy;
+
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnPipelineLoadingProgress, float, Progress);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnPipelineLoaded, bool, bSuccess);
 using FMIDIGeneratorProxyPtr = TSharedPtr<FMIDIGeneratorProxy, ESPMode::ThreadSafe>;
 
-DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing1"), STAT_GenThread_LogitProcessing1, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing2"), STAT_GenThread_LogitProcessing2, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing3"), STAT_GenThread_LogitProcessing3, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing4"), STAT_GenThread_LogitProcessing4, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing5"), STAT_GenThread_LogitProcessing5, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing6"), STAT_GenThread_LogitProcessing6, STATGROUP_Game);
 DECLARE_CYCLE_STAT(TEXT("GenThread::LogitProcessing7"), STAT_GenThread_LogitProcessing7, STATGROUP_Game);
-
-DECLARE_CYCLE_STAT(TEXT("GenThread::DecodeToken1"), STAT_GenThread_DecodeToken1, STATGROUP_Game);
-DECLARE_CYCLE_STAT(TEXT("GenThread::DecodeToken2"), STAT_GenThread_DecodeToken2, STATGROUP_Game);
-DECLARE_CYCLE_STAT(TEXT("GenThread::DecodeToken3"), STAT_GenThread_DecodeToken3, STATGROUP_Game);
+DECLARE_CYCLE_STAT(TEXT("GenThread::BuildPenaltyTable"), STAT_GenThread_BuildPenaltyTable, STATGROUP_Game);
+DECLARE_CYCLE_STAT(TEXT("GenThread::BuildMidiEvents"), STAT_GenThread_BuildMidiEvents, STATGROUP_Game);
+DECLARE_CYCLE_STAT(TEXT("GenThread::SpliceMidiEvents"), STAT_GenThread_SpliceMidiEvents, STATGROUP_Game);
 
 UENUM(BlueprintType) // This makes the enum usable in Blueprints
 enum class EScale : uint8
@@ -43,6 +48,44 @@ enum class EScale : uint8
 	Diminished
 };
 
+UENUM(BlueprintType)
+enum class ESamplingMode : uint8
+{
+	// rangeGroupWrite, sortLogits, stableSoftmax and topPSampling from the library
+	Library,
+	// FLogitsKernel, same sampling in fewer passes
+	Fused
+};
+
+// Generation parameters a branch is generated with
+USTRUCT(BlueprintType)
+struct MIDIGENERATORWRAPPER_API FMIDIGenerationSettings
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	int32 MinPitch = 40;
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	int32 MaxPitch = 60;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	float MinTimeShift = 0;
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	float MaxTimeShift = 2.0;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	bool bUseScale = false;
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	EScale Scale = EScale::IonianMajor;
+
+	bool operator==(const FMIDIGenerationSettings& Other) const
+	{
+		return MinPitch == Other.MinPitch && MaxPitch == Other.MaxPitch
+			&& MinTimeShift == Other.MinTimeShift && MaxTimeShift == Other.MaxTimeShift
+			&& bUseScale == Other.bUseScale && (!bUseScale || Scale == Other.Scale);
+	}
+};
+
 class FMIDIGeneratorProxy final : public Audio::TProxyData<FMIDIGeneratorProxy>
 {
 public:
@@ -63,8 +106,174 @@ public:
 	TSharedPtr<FMIDIGeneratorEnv> MidiGenerator;
 };
 
+// MIDI event built by the gen thread, the audio thread only adds it to the track of its role
+struct FGeneratedMidiEvent
+{
+	enum class ERole : uint8
+	{
+		Note,
+		// Copy of a note on another channel, only played by the doubled voice
+		DoubledNote,
+		Beat,
+		// Not an event, BatchIndex is the batch played as the first voice from now on
+		BranchSwitch,
+		// Not an event, the events of the batch from LibTick on have been removed by a fork
+		BranchFork,
+	};
+
+	FMidiEvent Event;
+	// Tick of the note the event comes from, to discard events removed by a rewind
+	int32 LibTick = 0;
+	int32 BatchIndex = 0;
+	// Rewind epoch when the note was published, see FGenThread::GetLastRewind()
+	uint32 Epoch = 0;
+	ERole Role = ERole::Note;
+};
+
+// Events of a voice that haven't been played yet, in the order they were generated
+// Only used by the audio thread, the storage is allocated by Reserve() and the oldest events are dropped when it's full
+struct FUpcomingMidiEvents
+{
+	void Reserve(int32 Capacity)
+	{
+		Events.SetNum(int32(FMath::RoundUpToPowerOfTwo(uint32(Capacity))));
+		Head = 0;
+		NbEvents = 0;
+	}
+
+	int32 Num() const { return NbEvents; }
+
+	const FGeneratedMidiEvent& operator[](int32 Index) const
+	{
+		return Events[(Head + Index) & (Events.Num() - 1)];
+	}
+
+	void Add(const FGeneratedMidiEvent& Event)
+	{
+		if (Events.IsEmpty())
+		{
+			return;
+		}
+		if (NbEvents == Events.Num())
+		{
+			Head = (Head + 1) & (Events.Num() - 1);
+			NbEvents--;
+		}
+		Events[(Head + NbEvents) & (Events.Num() - 1)] = Event;
+		NbEvents++;
+	}
+
+	// Drops the events before PlayedTick at the head, events are roughly in tick order
+	void RemovePlayed(int32 PlayedTick)
+	{
+		while (NbEvents > 0 && (*this)[0].Event.GetTick() < PlayedTick)
+		{
+			Head = (Head + 1) & (Events.Num() - 1);
+			NbEvents--;
+		}
+	}
+
+	// Removes the events of the notes from LibTick on, the other ones keep their order
+	void RemoveFromLibTick(int32 LibTick)
+	{
+		int32 NbKeptEvents = 0;
+		for (int32 Index = 0; Index < NbEvents; Index++)
+		{
+			const FGeneratedMidiEvent& Event = (*this)[Index];
+			if (Event.LibTick < LibTick)
+			{
+				Events[(Head + NbKeptEvents) & (Events.Num() - 1)] = Event;
+				NbKeptEvents++;
+			}
+		}
+		NbEvents = NbKeptEvents;
+	}
+
+private:
+	// Power of two sized
+	TArray<FGeneratedMidiEvent> Events;
+	int32 Head = 0;
+	int32 NbEvents = 0;
+};
+
+// One generated instrument, driven by the gen thread batch of the same index
+struct FMIDIGeneratorVoice
+{
+	RangeGroupHandle CurrentRangeGroup = nullptr;
+
+	// Only used by the gen thread
+	int32 nextBeatNoteIndexToProcess = 0;
+	int32 nbEncodedTokensSinceRegen = 0;
+
+	// Indices in MidiFileData->Tracks, INDEX_NONE for branches which aren't played
+	int32 NoteTrackIndex = 0;
+	int32 BeatTrackIndex = 1;
+	// Notes are also added to Tracks[1] on another channel
+	bool bIsDoubled = false;
+
+	// Generated events that haven't been played yet, spliced into the tracks when switching branches
+	FUpcomingMidiEvents UpcomingEvents;
+};
+
+// Alternative continuation of the first voice, generated in the same forward pass with other settings
+struct FMIDIGeneratorBranch
+{
+	FMIDIGenerationSettings Settings;
+	int32 BatchIndex = INDEX_NONE;
+};
+
+// Scale, pitch range and time shift range penalties of a range group for some settings,
+// one additive bias per token of the range group, in range order
+struct FMIDIPenaltyTable
+{
+	// False if the library transforms can't be expressed as a bias, they are applied on every token then
+	bool bIsAdditive = false;
+	TArray<float> CompactBias;
+};
+
+// Library range groups of the tokenizer and the allowed tokens of each, built by SetFilter() and never modified after
+struct FMIDIRangeGroups
+{
+	RangeGroupHandle BaseRangeGroup = nullptr;
+	RangeGroupHandle PitchTimeshiftRangeGroup = nullptr;
+	RangeGroupHandle PitchRangeGroup = nullptr;
+	RangeGroupHandle VelocityRangeGroup = nullptr;
+	RangeGroupHandle DurationRangeGroup = nullptr;
+	RangeGroupHandle TimeShiftRangeGroup = nullptr;
+	RangeGroupHandle AllRangeGroup = nullptr;
+
+	// Logits are only read and written through their spans, never over the whole vocabulary
+	TMap<RangeGroupHandle, FRangeGroupMask> Masks;
+
+	FMIDIRangeGroups() = default;
+	UE_NONCOPYABLE(FMIDIRangeGroups);
+	~FMIDIRangeGroups();
+};
+using FMIDIRangeGroupsPtr = TSharedPtr<const FMIDIRangeGroups, ESPMode::ThreadSafe>;
+
+// Penalty tables of some settings, keyed by range group
+// Empty until the range groups are built, the library transforms are applied on every token then
+struct FMIDIPenaltyTables
+{
+	FMIDIGenerationSettings Settings;
+	TMap<RangeGroupHandle, FMIDIPenaltyTable> Tables;
+};
+using FMIDIPenaltyTablesPtr = TSharedPtr<const FMIDIPenaltyTables, ESPMode::ThreadSafe>;
+
+// What the gen thread samples each batch with, built when the settings change and never modified once published
+struct FMIDISamplingSetup
+{
+	// Null until SetFilter() is called, the tables are empty then
+	FMIDIRangeGroupsPtr RangeGroups;
+	// Tables of the current settings first, then of each branch
+	TArray<FMIDIPenaltyTablesPtr> PenaltyTables;
+	// Batch generated with each of PenaltyTables, the first one is played as the first voice
+	// The other voices are generated with the current settings
+	TArray<int32> BatchIndices;
+};
+
 // Pipeline
-struct MIDIGENERATORWRAPPER_API FMIDIGeneratorEnv
+struct MIDIGENERATORWRAPPER_API FMIDIGeneratorEnv : public TSharedFromThis<FMIDIGeneratorEnv, ESPMode::ThreadSafe>
 {
 public:
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
@@ -87,36 +296,58 @@ public:
 
 	TSharedPtr<class FGenThread> GenThread = MakeShared<FGenThread>();
 
-	TArray<int32> NewEncodedTokens;
+	// Every voice is generated by the same forward pass
+	// The first NbVoices are played, the other ones are speculative branches of the first voice
+	TArray<FMIDIGeneratorVoice> Voices;
+	int32 NbVoices = 1;
+
+	// Forked from the first voice every NbTicksPerBranchFork ticks, so they continue what is being played
+	TArray<FMIDIGeneratorBranch> Branches;
+	// Batch played as the first voice once the last published setup is applied
+	int32 MainVoiceBatchIndex = 0;
+	// Batch whose events are played as the first voice, only used by the audio thread
+	int32 PlayedMainBatchIndex = 0;
+	int32 NbTicksPerBranchFork = 32;
+	// Capacity of FMIDIGeneratorVoice::UpcomingEvents, only reserved when there are branches
+	int32 NbMaxUpcomingEvents = 2048;
+	int32 LastBranchForkTick = INT_MIN;
+	uint32 LastSeenRewindEpoch = 0;
+	// Value of FGenThread::GetGeneratedUntilVersion() when the audio thread last woke the gen thread up
+	uint32 LastWakeUpVersion = 0;
+
 	bool bShouldUpdateTokens = false;
 	TArray<int32> DecodedTokens;
 
 	TSharedPtr<struct FMidiFileData> MidiFileData;
 	FMidiFileProxyPtr MidiDataProxy;
 
+	// Built by the gen thread from the notes of every batch
+	TSPSCRing<FGeneratedMidiEvent, 4096> GeneratedEvents;
+
+	// Events decoded for each of MidiFileData->Tracks, merged once they are about to be played
+	TArray<FMidiEventStager> TrackStagers;
+	// In UE ticks, staged events closer than that to the playhead are flushed to the tracks
+	int32 StagingHorizonTicks = 1000;
+
+	// Number of bars kept behind the playhead, older note events are trimmed from every track
+	// Negative to keep everything
+	int32 NbRetainedBars = 4;
+	int32 LastTrimTick = 0;
+	// Events kept while a track is trimmed, reused so the audio thread doesn't allocate once it has grown
+	TArray<FMidiEvent> TrimmedTrackEvents;
+	// Incremented each time events are removed from the tracks, cursors relying on event indices must seek again
+	int32 NbTrackCompactions = 0;
+
 	MidiConverterHandle converter = nullptr;
-	RangeGroupHandle CurrentRangeGroup = nullptr;
 
 	int32 CurrentTick = 0;
 	int32 AddedTicks = 0;
 
-	int32 nextNoteIndexToProcess = 0;
-	int32 nextBeatNoteIndexToProcess = 0;
-
-	RangeGroupHandle BaseRangeGroup;
-	RangeGroupHandle PitchTimeshiftRangeGroup;
-	RangeGroupHandle PitchRangeGroup;
-	RangeGroupHandle VelocityRangeGroup;
-	RangeGroupHandle DurationRangeGroup;
-	RangeGroupHandle TimeShiftRangeGroup;
-	RangeGroupHandle AllRangeGroup;
-
 	const HarmonixMetasound::FMidiClock* Clock = nullptr;
 	FCriticalSection ClockLock;
 
 
 	bool hasRegen = false;
-	int32 nbEncodedTokensSinceRegen = 0;
 	int nbAddedSinceLastTimeshift = 0;
 	int nbAddedSinceLast = 0;
 
@@ -127,8 +358,36 @@ public:
 	int32 callbackHash = -1;
 	float callbackTime = 0;
 
+	ESamplingMode SamplingMode = ESamplingMode::Fused;
+	// Only used by the gen thread
+	FLogitsKernel LogitsKernel;
+	// Library sampling mode scratch, logits of the allowed tokens and their order
+	TArray<float> SparseLogits;
+	TArray<int32> SparseLogitIndices;
+
+	// Settings, Branches, MainVoiceBatchIndex, RangeGroups and PenaltyTables are only modified with it locked,
+	// a new FMIDISamplingSetup is then published to the gen thread
+	FCriticalSection SettingsMutex;
+	FMIDIRangeGroupsPtr RangeGroups;
+	// Tables of the current settings first, then of each branch, rebuilt by the setters
+	TArray<FMIDIPenaltyTablesPtr> PenaltyTables;
+	// Latest setup, the gen thread takes it before its next token
+	std::atomic<FMIDISamplingSetup*> PendingSamplingSetup = nullptr;
+	// Only used by the gen thread
+	TUniquePtr<FMIDISamplingSetup> SamplingSetup;
+	// Per batch, index in SamplingSetup->PenaltyTables
+	TArray<int32> BatchPenaltyTables;
+	// Set by AddFireworkEffect(), its observer applies its own penalties while the effect plays
+	bool bHasFireworkEffect = false;
+
 	const int32_t* Scale = nullptr;
 	int32_t ScaleSize = 0;
+	EScale CurrentScale = EScale::IonianMajor;
+
+	// Set while the model is loaded on a worker thread, StartGeneration() then only starts the gen thread once it's loaded
+	FCriticalSection PipelineLoadingMutex;
+	bool bIsPipelineLoading = false;
+	bool bIsStartQueued = false;
 
 public:
 	~FMIDIGeneratorEnv();
@@ -140,15 +399,69 @@ public:
 	// @TODO : remove
 	// should be initialized with a TokenizerAsset and a ModelAsset instead
 	void PreStart(const FString& TokenizerPath, const FString& ModelPath, const TArray<int32>& InTokens);
-	void PreloadPipeline(const FString& ModelPath);
+	// Returns false if the model couldn't be loaded
+	bool PreloadPipeline(const FString& ModelPath);
+	// Callbacks are called from the worker thread
+	void PreloadPipelineAsync(const FString& ModelPath, TFunction<void(float Progress)> OnProgress, TFunction<void(bool bSuccess)> OnCompleted);
+	bool IsPipelineLoading();
 	void SetTokens(const TArray<int32>& InTokens);
-
+	// Must be called before StartGeneration()
+	void SetNbVoices(int32 InNbVoices);
+	// Must be called before StartGeneration(), returns the branch index
+	int32 AddBranch(const FMIDIGenerationSettings& Settings);
+	// Plays the notes already generated by the branch from the playhead, with no inference latency
+	// The settings of the branch become the current settings, and the current ones become the branch
+	// Applied by the gen thread before its next token
+	void SwitchToBranch(int32 BranchIndex);
+
+	void GetSettings(FMIDIGenerationSettings& OutSettings) const;
+	// The penalty tables of the new settings are built before returning, the gen thread uses them from its next token
+	void SetSettings(const FMIDIGenerationSettings& Settings);
+	void SetScale(EScale InScale);
+	void SetPitchRange(int32 MinPitch, int32 MaxPitch);
+	void SetTimeShiftRange(float MinTimeShift, float MaxTimeShift);
+	static void GetScaleNotes(EScale InScale, const int32_t*& OutScale, int32_t& OutScaleSize);
+
+	// Scale, pitch range and time shift range penalties, as done by the library for each token
+	void ApplyPenaltyTransforms(float* Logits, RangeGroupHandle RangeGroup, const FMIDIGenerationSettings& Settings) const;
+	// Gen thread, masks of the range groups in use
+	const FRangeGroupMask& GetRangeGroupMask(RangeGroupHandle RangeGroup) const;
+	const TArray<FLogitsKernel::FSpan>& GetRangeGroupSpans(RangeGroupHandle RangeGroup) const;
+	FMIDIPenaltyTablesPtr BuildPenaltyTables(const FMIDIGenerationSettings& Settings) const;
+	// Gen thread, applies the penalties that can't be expressed as a bias to the logits
+	// Returns the bias to add to the logits of the current range group of the batch, nullptr if there is none
+	const float* ApplyPenalties(int32 BatchIndex, float* Logits) const;
+
+	// Builds the range groups of the tokenizer, the gen thread uses them from its next token
 	void SetFilter();
+	// Gen thread, must be called once the first range groups are in use
+	void SetSearchStrategy();
+	// Gen thread, returns the number of notes whose events could be pushed to GeneratedEvents
+	int32 BuildMidiEvents(int32 BatchIndex, const Note* Notes, int32 NbNotes, uint32 Epoch);
+	// Must be called with SettingsMutex locked
+	void ApplySettings(const FMIDIGenerationSettings& Settings);
+	// Must be called with SettingsMutex locked, builds the tables of the settings that changed and publishes them
+	void UpdatePenaltyTables();
+	void PublishSamplingSetup();
+	// Gen thread, takes the pending setup if any, and starts playing another branch if it was switched to
+	void AdoptSamplingSetup();
+	// Gen thread, forks the branches from the first voice
+	void UpdateBranches(bool bIsForced);
+	// Gen thread, after the history of the batch was rewound
+	void SyncVoiceWithHistory(int32 BatchIndex);
+	// Returns INDEX_NONE if the event isn't played
+	static int32 GetEventTrackIndex(const FMIDIGeneratorVoice& Voice, FGeneratedMidiEvent::ERole Role);
+	// Audio thread
 	void DecodeTokens();
+	// Audio thread, gives the tracks of the first voice to the batch and plays what it already generated
+	void SwitchPlayedBatch(int32 BatchIndex);
+	// Audio thread, removes the note events more than NbRetainedBars behind the playhead from every track
+	void TrimConsumedEvents();
+	bool RemoveNoteEventsBefore(FMidiTrack& Track, int32 Tick);
 
 	void SetClock(const HarmonixMetasound::FMidiClock& InClock);
 	void RegenerateCacheAfterDelay(float DelayInMs);
-	void UpdateCurrentRangeGroup(int32 LastDecodedToken);
+	void UpdateCurrentRangeGroup(int32 VoiceIndex, int32 LastDecodedToken);
 
 	int32 UETickToGenLibTick(float tick);
 	float GenLibTickToUETick(int32 tick);
@@ -180,6 +493,13 @@ public:
 	int32 maxIntensity = 100000;
 	UPROPERTY(BlueprintReadWrite, EditAnywhere)
 	int32 minIntensity = 0;
+
+	// Broadcast on the game thread while PreloadPipelineAsync loads the model
+	UPROPERTY(BlueprintAssignable)
+	FOnPipelineLoadingProgress OnPipelineLoadingProgress;
+
+	UPROPERTY(BlueprintAssignable)
+	FOnPipelineLoaded OnPipelineLoaded;
 	
 public:
 	UMIDIGeneratorEnv();
@@ -199,6 +519,10 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void PreloadPipeline(const FString& ModelPath);
 
+	// Loads the model on a worker thread, StartGeneration can be called in the meantime
+	UFUNCTION(BlueprintCallable)
+	void PreloadPipelineAsync(const FString& ModelPath);
+
 	UFUNCTION(BlueprintCallable)
 	void SetFilter();
 
@@ -208,6 +532,17 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void SetTokens(const TArray<int32>& InTokens);
 
+	// Number of instruments generated together, must be called before StartGeneration
+	UFUNCTION(BlueprintCallable)
+	void SetNbVoices(int32 NbVoices);
+
+	// Generates an alternative continuation with other settings, must be called before StartGeneration
+	UFUNCTION(BlueprintCallable)
+	int32 AddBranch(const FMIDIGenerationSettings& Settings);
+
+	UFUNCTION(BlueprintCallable)
+	void SwitchToBranch(int32 BranchIndex);
+
 	UFUNCTION(BlueprintCallable)
 	void SetTempo(float InTempo);
 
@@ -229,12 +564,24 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void GetTimeShiftRange(float& OutMinTimeShift, float& OutMaxTimeShift) const;
 
+	UFUNCTION(BlueprintCallable)
+	void SetSamplingMode(ESamplingMode SamplingMode);
+
 	UFUNCTION(BlueprintCallable)
 	void SetGenerateBeats(bool doesGenerate);
 
 	UFUNCTION(BlueprintCallable)
 	void SetPlayFireworkEffect(bool shouldPlayEffect);
 
+	// Number of bars of generated MIDI kept behind the playhead, negative to keep the whole session
+	UFUNCTION(BlueprintCallable)
+	void SetRetentionWindow(int32 NbBars);
+
+	// Generation resumes when less than TargetLookaheadMs of notes are ahead of the playhead,
+	// and pauses again once HysteresisMs further ahead
+	UFUNCTION(BlueprintCallable)
+	void SetLookahead(float TargetLookaheadMs = 1000.0f, float HysteresisMs = 3000.0f);
+
 	//~Begin IAudioProxyDataFactory Interface.
 	virtual TSharedPtr<Audio::IProxyData> CreateProxyData(const Audio::FProxyDataInitParams& InitParams) override;
 	//~ End IAudioProxyDataFactory Interface.
@@ -0,0 +1,85 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "fwd.h"
+
+// Pipeline of a pooled model, it goes back to the model when the last reference is released
+using FMIDIPipelinePtr = TSharedPtr<IAutoRegressivePipeline, ESPMode::ThreadSafe>;
+
+/**
+ * Model loaded once and shared by every generator using the same model folder.
+ * Destroyed with its onnx env when the last generator releases it.
+ */
+class MIDIGENERATORWRAPPER_API FPooledMIDIModel : public TSharedFromThis<FPooledMIDIModel, ESPMode::ThreadSafe>
+{
+public:
+	FPooledMIDIModel(EnvHandle InEnv, AModel* InModel, const FString& InModelPath);
+	~FPooledMIDIModel();
+
+	FPooledMIDIModel(const FPooledMIDIModel&) = delete;
+	FPooledMIDIModel& operator=(const FPooledMIDIModel&) = delete;
+
+	// Each running generator drives its own pipeline (batches, histories, KV cache) from its gen thread,
+	// the onnx session holding the weights is shared
+	// Returns a pipeline released by a generator that stopped if any, so its buffers are reused
+	// The pipeline keeps the model alive
+	FMIDIPipelinePtr AcquirePipeline();
+
+	AModel* GetModel() const
+	{
+		return Model;
+	}
+
+	const FString& GetModelPath() const
+	{
+		return ModelPath;
+	}
+
+	int32 GetNbIdlePipelines();
+
+private:
+	// Called when the last reference to a pipeline is released
+	void ReleasePipeline(IAutoRegressivePipeline* Pipeline);
+
+	EnvHandle Env = nullptr;
+	AModel* Model = nullptr;
+	FString ModelPath;
+
+	FCriticalSection PipelinesMutex;
+	// The library doesn't export the pipeline types and IPipeline has no virtual destructor,
+	// so pipelines can't be deleted from here, they are kept for the next generator instead
+	TArray<IAutoRegressivePipeline*> IdlePipelines;
+};
+
+using FPooledMIDIModelPtr = TSharedPtr<FPooledMIDIModel, ESPMode::ThreadSafe>;
+
+/**
+ * Process-wide cache of loaded models, keyed by absolute model folder path.
+ * The pool only keeps weak references, models are refcounted by the generators using them.
+ */
+class MIDIGENERATORWRAPPER_API FMIDIModelPool
+{
+public:
+	static FMIDIModelPool& Get();
+
+	// Returns the already loaded model if any generator still uses it, loads it otherwise
+	// A caller asking for a model being loaded waits for that load, the pool isn't locked while loading
+	// Returns nullptr if the model couldn't be loaded
+	FPooledMIDIModelPtr FindOrLoad(const FString& AbsoluteModelPath);
+
+	int32 GetNbLoadedModels();
+
+private:
+	FPooledMIDIModelPtr Load(const FString& Key);
+
+	FCriticalSection Mutex;
+	TMap<FString, TWeakPtr<FPooledMIDIModel, ESPMode::ThreadSafe>> Models;
+	// Models being loaded, by key
+	TMap<FString, TSharedFuture<FPooledMIDIModelPtr>> PendingLoads;
+
+	// The builders are shared and are given the env of the model to load, so loads still go one at a time
+	FCriticalSection BuilderMutex;
+};
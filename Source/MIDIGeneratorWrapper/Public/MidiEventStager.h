@@ -0,0 +1,48 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HarmonixMidi/MidiTrack.h"
+
+/**
+ * Staging buffer for the events generated for a track.
+ * Events are appended in O(1), then only the staged batch is sorted and merged with the end of the track,
+ * so the cost of a flush doesn't depend on the length of the track.
+ * The track must be sorted, it stays sorted.
+ */
+class MIDIGENERATORWRAPPER_API FMidiEventStager
+{
+public:
+	void AddEvent(const FMidiEvent& Event);
+
+	// Same semantics as FMidiTrack::ClearEventsAfter()
+	void ClearEventsAfter(int32 Tick, bool IncludeTick);
+
+	// Adds all the staged events to the track, in tick order
+	void FlushTo(FMidiTrack& Track);
+
+	// Only flushes when a staged event is about to be played, so several notes share the same merge
+	bool FlushIfNeeded(FMidiTrack& Track, int32 CurrentTick, int32 HorizonTicks);
+
+	bool IsEmpty() const
+	{
+		return PendingEvents.IsEmpty();
+	}
+
+	int32 Num() const
+	{
+		return PendingEvents.Num();
+	}
+
+	int32 GetEarliestTick() const
+	{
+		return EarliestTick;
+	}
+
+private:
+	TArray<FMidiEvent> PendingEvents;
+	// Events of the track after the first staged one, usually only the far away AllNotesKill event
+	TArray<FMidiEvent> TailEvents;
+	int32 EarliestTick = TNumericLimits<int32>::Max();
+};
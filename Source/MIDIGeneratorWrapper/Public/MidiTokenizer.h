@@ -7,7 +7,9 @@
 #include "HarmonixMidi/MidiMsg.h"
 
 /**
- * 
+ * Converts tokens to notes as they are appended.
+ * The converter is kept between updates, so each update only processes the new tokens.
+ * Every token is kept, the library has no public way to drop the undo state of the oldest ones.
  */
 class MIDIGENERATORWRAPPER_API FMidiConverter
 {
@@ -15,15 +17,44 @@ public:
 	FMidiConverter();
 	~FMidiConverter();
 
+	UE_NONCOPYABLE(FMidiConverter);
 
-	MidiTokenizerHandle tok;
-	RedirectorHandle redirector;
+	MidiTokenizerHandle tok = nullptr;
+	RedirectorHandle redirector = nullptr;
 
 	TArray<int32> tokens;
+	// Index after the token that produced the last note
 	int32 unplayedTokenIndex = 0;
 
+	// Called for each new note, during update()
+	TFunction<void(const Note& NewNote)> OnNote;
+
+	// Must be called before update(), the converter is then created from the tokenizer instead of being TSD
+	void setTokenizer(MidiTokenizerHandle InTokenizer);
 
 	void update();
 
+	// Removes the tokens from TokenIndex, undoing what the converter did with them
+	// Converters that can't undo are created again and given the kept tokens, without calling OnNote
+	void removeTokensFrom(int32 TokenIndex);
+
+	// Token being processed, while in OnNote
+	int32 GetProcessedTokenIndex() const { return nextTokenIndexToProcess; }
+	bool IsReplaying() const { return bIsReplaying; }
+
+private:
+	void createConverter();
+
+	MidiConverterHandle converter = nullptr;
+	// Only the TSD converter implements MIDIConverter::undo(), the other ones are rebuilt from the tokens
+	bool bCanUndo = false;
+	// Set while the kept tokens are given again to a rebuilt converter
+	bool bIsReplaying = false;
+
+	// Tokens before this index have been given to the converter
+	int32 nextTokenIndexToProcess = 0;
 
+	// A note is a Pitch followed by its Velocity and Duration,
+	// the last tokens are kept for the next update until the note is complete
+	static constexpr int32 NbNoteLookaheadTokens = 2;
 };
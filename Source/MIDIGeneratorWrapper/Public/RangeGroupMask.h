@@ -0,0 +1,72 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "LogitsKernel.h"
+#include "fwd.h"
+
+/**
+ * Immutable set of tokens, as spans, as a sorted index list and as a vocab-sized bitmask.
+ * Built once when the tokenizer or the filter changes, then read by the sampling kernels without rebuilding any cache.
+ * Composite constraints are built with And() / Or(), which combine the bitmasks 128 bits at a time.
+ */
+class MIDIGENERATORWRAPPER_API FRangeGroupMask
+{
+public:
+	FRangeGroupMask() = default;
+
+	static FRangeGroupMask FromSpans(TArrayView<const FLogitsKernel::FSpan> InSpans, int32 InVocabSize);
+	// The range group cache must be up to date
+	static FRangeGroupMask FromRangeGroup(RangeGroupHandle RangeGroup, int32 InVocabSize);
+
+	// The vocab size is the largest of both
+	static FRangeGroupMask And(const FRangeGroupMask& A, const FRangeGroupMask& B);
+	static FRangeGroupMask Or(const FRangeGroupMask& A, const FRangeGroupMask& B);
+
+	FORCEINLINE bool Contains(int32 Token) const
+	{
+		const uint32 WordIndex = uint32(Token) >> 6;
+		return WordIndex < uint32(Bits.Num()) && ((Bits.GetData()[WordIndex] >> (Token & 63)) & 1) != 0;
+	}
+
+	// Sorted, contiguous tokens are merged
+	const TArray<FLogitsKernel::FSpan>& GetSpans() const
+	{
+		return Spans;
+	}
+
+	// Sorted
+	const TArray<int32>& GetIndices() const
+	{
+		return Indices;
+	}
+
+	// Bit T is set if the token T is in the mask, padded to a multiple of 128 bits
+	TArrayView<const uint64> GetBits() const
+	{
+		return Bits;
+	}
+
+	int32 GetNbTokens() const
+	{
+		return Indices.Num();
+	}
+
+	int32 GetVocabSize() const
+	{
+		return VocabSize;
+	}
+
+private:
+	template<typename FCombine>
+	static FRangeGroupMask Combine(const FRangeGroupMask& A, const FRangeGroupMask& B, FCombine CombineWords);
+
+	// Spans and indices from the bits
+	void BuildFromBits();
+
+	int32 VocabSize = 0;
+	TArray<uint64, TAlignedHeapAllocator<16>> Bits;
+	TArray<FLogitsKernel::FSpan> Spans;
+	TArray<int32> Indices;
+};
@@ -0,0 +1,76 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include <atomic>
+
+/**
+ * Bounded single-producer / single-consumer ring buffer.
+ * Push() must only be called by the producer thread, Pop() only by the consumer thread.
+ * Neither side ever locks or allocates: pushing into a full ring fails and increments the overrun counter.
+ */
+template<typename T, uint32 Capacity>
+class TSPSCRing
+{
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "TSPSCRing capacity must be a power of two");
+
+public:
+	bool Push(const T& Item)
+	{
+		const uint32 Head = WriteIndex.load(std::memory_order_relaxed);
+		const uint32 Tail = ReadIndex.load(std::memory_order_acquire);
+		if (Head - Tail >= Capacity)
+		{
+			NbOverruns.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		Items[Head & (Capacity - 1)] = Item;
+		WriteIndex.store(Head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(T& OutItem)
+	{
+		const uint32 Tail = ReadIndex.load(std::memory_order_relaxed);
+		const uint32 Head = WriteIndex.load(std::memory_order_acquire);
+		if (Tail == Head)
+		{
+			return false;
+		}
+
+		OutItem = Items[Tail & (Capacity - 1)];
+		ReadIndex.store(Tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate when called from a thread that is neither the producer nor the consumer
+	uint32 Num() const
+	{
+		return WriteIndex.load(std::memory_order_acquire) - ReadIndex.load(std::memory_order_acquire);
+	}
+
+	bool IsFull() const
+	{
+		return Num() >= Capacity;
+	}
+
+	uint32 GetNbOverruns() const
+	{
+		return NbOverruns.load(std::memory_order_relaxed);
+	}
+
+	static constexpr uint32 GetCapacity()
+	{
+		return Capacity;
+	}
+
+private:
+	// Producer and consumer indices live on separate cache lines to avoid false sharing
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> WriteIndex = 0;
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint32> ReadIndex = 0;
+	std::atomic<uint32> NbOverruns = 0;
+
+	T Items[Capacity];
+};
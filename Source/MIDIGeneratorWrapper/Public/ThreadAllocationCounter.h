@@ -0,0 +1,23 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * Counts the heap allocations made through GMalloc by each thread.
+ * Disabled by default, -MIDIGenCountAllocations wraps GMalloc with a counting proxy when the module starts up,
+ * it is only removed when the module shuts down.
+ * Allocations made by the generator library with the CRT allocator aren't counted.
+ */
+class MIDIGENERATORWRAPPER_API FThreadAllocationCounter
+{
+public:
+	static bool IsEnabled();
+	// Called by the module
+	static void Install();
+	static void Uninstall();
+
+	// Allocations made by the calling thread since it started, 0 while disabled
+	static uint32 GetNbAllocations();
+};
@@ -5,101 +5,144 @@
 #include "CoreMinimal.h"
 #include "Engine/DataAsset.h"
 #include "gen.h"
+#include "TokenizerTables.h"
+#include "RangeGroupMask.h"
 #include "TokenizerAsset.generated.h"
 
 struct FTokenizer;
 class FTokenizerProxy;
 using FTokenizerProxyPtr = TSharedPtr<FTokenizerProxy, ESPMode::ThreadSafe>;
+// Tokenizers are immutable once loaded, and shared by every asset, proxy and gen thread using the same file, see FTokenizerRegistry
+using FTokenizerPtr = TSharedPtr<const FTokenizer, ESPMode::ThreadSafe>;
 
 class FTokenizerProxy final : public Audio::TProxyData<FTokenizerProxy>
 {
 public:
 	IMPL_AUDIOPROXY_CLASS(FTokenizerProxy);
 
-	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(MidiTokenizerHandle InTokenizer)
-		: Tokenizer(MakeShared<FTokenizer>(InTokenizer))
-	{
-
-	}
-	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(UTokenizerAsset* InTokenizer)
-	{
-
-	}
-	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(const TSharedPtr<FTokenizer>& InTokenizer)
-	{
+	// Takes ownership of the tokenizer
+	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(MidiTokenizerHandle InTokenizer);
+	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(UTokenizerAsset* InTokenizer);
+	MIDIGENERATORWRAPPER_API explicit FTokenizerProxy(const FTokenizerPtr& InTokenizer);
 
-	}
-
-	TSharedPtr<FTokenizer> GetTokenizer()
+	const FTokenizerPtr& GetTokenizer() const
 	{
 		return Tokenizer;
 	}
 
-	TSharedPtr<FTokenizer> Tokenizer = MakeShared<FTokenizer>();
+	// Never null, the tokenizer is empty if it couldn't be loaded
+	FTokenizerPtr Tokenizer;
 };
 
+/**
+ * Classification and decoding are looked up in tables built once at load, without calling into the library.
+ */
 struct MIDIGENERATORWRAPPER_API FTokenizer
 {
 private:
 	MidiTokenizerHandle Tokenizer = nullptr;
 
+	TSharedPtr<const FTokenizerTables> Tables;
+
+	// Bit D of ClassBits[C] is set if the decoded token D is of class C
+	TArray<uint64> ClassBits[int32(ETokenClass::Count)];
+
+	// Encoded tokens starting by a decoded token of the class
+	FRangeGroupMask ClassMasks[int32(ETokenClass::Count)];
+
+	// CSR encoded -> decoded mapping, pointing into Tables
+	const int32* DecodeOffsets = nullptr;
+	const int32* DecodedTokens = nullptr;
+
+	int32 NbEncodedTokens = 0;
+	int32 NbDecodedTokens = 0;
+	bool bUseVelocities = false;
+	bool bUseDuration = false;
+	bool bUseTimeSignatures = false;
+
+	void BuildLookupTables();
+
+	FORCEINLINE bool IsOfClass(ETokenClass Class, int32 decodedToken) const
+	{
+		const TArray<uint64>& Bits = ClassBits[int32(Class)];
+		const uint32 WordIndex = uint32(decodedToken) >> 6;
+		return WordIndex < uint32(Bits.Num()) && ((Bits.GetData()[WordIndex] >> (decodedToken & 63)) & 1) != 0;
+	}
+
 public:
 	FTokenizer() = default;
-	FTokenizer(MidiTokenizerHandle InTokenizer)
-		: Tokenizer(InTokenizer)
-	{
+	// Takes ownership of the tokenizer, the tables are built from it if not given
+	explicit FTokenizer(MidiTokenizerHandle InTokenizer, const TSharedPtr<const FTokenizerTables>& InTables = nullptr);
+	~FTokenizer();
 
-	}
+	UE_NONCOPYABLE(FTokenizer);
 
 	bool IsPitch(int32 decodedToken) const
 	{
-		return isPitch(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::Pitch, decodedToken);
 	}
 	bool IsVelocity(int32 decodedToken) const
 	{
-		return isVelocity(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::Velocity, decodedToken);
 	}
 	bool IsDuration(int32 decodedToken) const
 	{
-		return isDuration(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::Duration, decodedToken);
 	}
 	bool IsTimeShift(int32 decodedToken) const
 	{
-		return isTimeShift(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::TimeShift, decodedToken);
 	}
 
 	bool IsPosition(int32 decodedToken) const
 	{
-		return isPosition(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::Position, decodedToken);
 	}
 
 	bool IsBarNone(int32 decodedToken) const
 	{
-		return isBarNone(Tokenizer, decodedToken);
+		return IsOfClass(ETokenClass::BarNone, decodedToken);
+	}
+
+	// Empty if the token is out of the vocabulary
+	TArrayView<const int32> DecodeToken(int32 encodedToken) const
+	{
+		if (uint32(encodedToken) >= uint32(NbEncodedTokens))
+		{
+			return TArrayView<const int32>();
+		}
+		const int32 Begin = DecodeOffsets[encodedToken];
+		return TArrayView<const int32>(DecodedTokens + Begin, DecodeOffsets[encodedToken + 1] - Begin);
+	}
+
+	// Same tokens as tokenizer_addTokensStartingBy*()
+	const FRangeGroupMask& GetClassMask(ETokenClass Class) const
+	{
+		return ClassMasks[int32(Class)];
 	}
 
 	int32 GetNbDecodedTokens() const
 	{
-		return tokenizer_getNbDecodedTokens(Tokenizer);
+		return NbDecodedTokens;
 	}
 	int32 GetNbEncodedTokens() const
 	{
-		return tokenizer_getNbEncodedTokens(Tokenizer);
+		return NbEncodedTokens;
 	}
 
 	bool UseVelocities() const
 	{
-		return tokenizer_useVelocities(Tokenizer);
+		return bUseVelocities;
 	}
 
 	bool UseDuration() const
 	{
-		return tokenizer_useDuration(Tokenizer);
+		return bUseDuration;
 	}
 
 	bool UseTimeSignatures() const
 	{
-		return tokenizer_useTimeSignatures(Tokenizer);
+		return bUseTimeSignatures;
 	}
 
 	const char* GetTokenizationType() const
@@ -110,14 +153,19 @@ public:
 
 	const char* DecodedTokenToString(int32 decodedToken) const
 	{
-		return tokenizer_decodedTokenToString(Tokenizer, decodedToken);
+		if (!Tables.IsValid() || uint32(decodedToken) >= uint32(Tables->DecodedTokenStringOffsets.Num()))
+		{
+			return nullptr;
+		}
+		return Tables->DecodedTokenStrings.GetData() + Tables->DecodedTokenStringOffsets[decodedToken];
 	}
 
+	// Returns true on success, the previous tokenizer is released
 	bool Load(const FString& TokenizerPath);
 
 	bool IsValid() const
 	{
-		return Tokenizer == nullptr;
+		return Tokenizer != nullptr;
 	}
 
 	void LoadIfInvalid(const FString& TokenizerPath)
@@ -132,6 +180,11 @@ public:
 	{
 		return Tokenizer;
 	}
+
+	const TSharedPtr<const FTokenizerTables>& GetTables() const
+	{
+		return Tables;
+	}
 };
 
 /**
@@ -145,11 +198,21 @@ class MIDIGENERATORWRAPPER_API UTokenizerAsset : public UPrimaryDataAsset, publi
 private:
 	FTokenizerProxyPtr Tokenizer;
 
+	// Cooked with the asset, so they don't have to be built at runtime, the library still parses the JSON file
+	TSharedPtr<FTokenizerTables> CookedTables;
+
 protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite)
 	FString TokenizerPath;
 
 public:
+	virtual void Serialize(FArchive& Ar) override;
+
+#if WITH_EDITOR
+	// Builds the tables again if the JSON file changed since they were cooked
+	void CookTables();
+#endif
+
 	UFUNCTION(BlueprintCallable)
 	void TryLoadTokenizer();
 
@@ -177,6 +240,9 @@ public:
 		}
 	}
 
+	// Loads the tokenizer if needed, returns an empty tokenizer if it couldn't be loaded
+	FTokenizerPtr GetSharedTokenizer();
+
 	FTokenizerProxyPtr GetTokenizerPtr() const
 	{
 		return Tokenizer;
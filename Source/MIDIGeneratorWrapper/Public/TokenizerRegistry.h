@@ -0,0 +1,41 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "TokenizerAsset.h"
+
+/**
+ * Process-wide cache of loaded tokenizers, keyed by the MD5 of their JSON file,
+ * so assets pointing to copies of the same file share the same tokenizer.
+ * The registry only keeps weak references, tokenizers are refcounted by the assets, proxies and gen threads using them.
+ */
+class MIDIGENERATORWRAPPER_API FTokenizerRegistry
+{
+public:
+	static FTokenizerRegistry& Get();
+
+	// Returns the already loaded tokenizer if anything still uses it, loads it otherwise
+	// The JSON file is always parsed by the library, the cooked tables only replace building the tables if built from the same content
+	// In cooked builds, the hash stored in the cooked tables is used as is, otherwise the file is hashed when it changed
+	// Returns nullptr if the tokenizer couldn't be loaded
+	FTokenizerPtr FindOrLoad(const FString& AbsoluteTokenizerPath, const TSharedPtr<const FTokenizerTables>& CookedTables = nullptr);
+
+	int32 GetNbLoadedTokenizers();
+
+private:
+	// Hashes the file if it changed since it was last hashed, returns an invalid hash if it can't be read
+	FMD5Hash HashFile(const FString& AbsoluteTokenizerPath);
+
+	struct FHashedFile
+	{
+		FDateTime ModificationTime;
+		int64 FileSize = 0;
+		FMD5Hash Hash;
+	};
+
+	FCriticalSection Mutex;
+	TMap<FString, TWeakPtr<const FTokenizer, ESPMode::ThreadSafe>> Tokenizers;
+	// By absolute path
+	TMap<FString, FHashedFile> HashedFiles;
+};
@@ -0,0 +1,79 @@
+// Copyright Prog'z. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/SecureHash.h"
+#include "gen.h"
+
+enum class ETokenClass : uint8
+{
+	Pitch,
+	Velocity,
+	Duration,
+	TimeShift,
+	Position,
+	BarNone,
+	Count,
+};
+
+// Encoded tokens [Begin, Begin + Size)
+struct FTokenRange
+{
+	int32 Begin = 0;
+	int32 Size = 0;
+
+	friend FArchive& operator<<(FArchive& Ar, FTokenRange& TokenRange)
+	{
+		Ar << TokenRange.Begin;
+		Ar << TokenRange.Size;
+		return Ar;
+	}
+};
+
+/**
+ * Everything the wrapper queries from a tokenizer, in flat arrays.
+ * Built once from a loaded tokenizer, then cooked into the UTokenizerAsset and bulk-loaded with it.
+ * The BPE vocabulary and merges stay in the library, which can only load them from the JSON file.
+ */
+struct MIDIGENERATORWRAPPER_API FTokenizerTables
+{
+	// MD5 of the JSON file the tables were built from, computed when cooking so cooked builds never hash the file
+	FMD5Hash SourceHash;
+
+	int32 NbEncodedTokens = 0;
+	int32 NbDecodedTokens = 0;
+	bool bUseVelocities = false;
+	bool bUseDuration = false;
+	bool bUseTimeSignatures = false;
+	FString TokenizationType;
+
+	// The decoded tokens of the encoded token E are DecodedTokens[DecodeOffsets[E], DecodeOffsets[E + 1])
+	TArray<int32> DecodeOffsets;
+	TArray<int32> DecodedTokens;
+
+	// Bit (1 << ETokenClass) is set for each class of the decoded token
+	TArray<uint8> DecodedTokenClasses;
+
+	// Null-terminated strings of the decoded tokens, starting at DecodedTokenStringOffsets[D]
+	TArray<ANSICHAR> DecodedTokenStrings;
+	TArray<int32> DecodedTokenStringOffsets;
+
+	// Encoded tokens starting by a decoded token of the class, as added by tokenizer_addTokensStartingBy*()
+	TArray<FTokenRange> EncodedClassRanges[int32(ETokenClass::Count)];
+
+	bool Build(MidiTokenizerHandle Tokenizer, const FMD5Hash& InSourceHash);
+	// Returns false if the data wasn't written by this version, it is skipped and the tables are then invalid
+	bool Serialize(FArchive& Ar);
+	// Same data without the size prefix, data written by another version can't be skipped
+	bool SerializeUnsized(FArchive& Ar);
+
+	bool IsValid() const
+	{
+		return NbEncodedTokens > 0;
+	}
+
+	SIZE_T GetAllocatedSize() const;
+
+	static FMD5Hash HashFile(const FString& FilePath);
+};
@@ -30,6 +30,7 @@
 #include "MetasoundMIDIGenerator.h"
 #include "GenThread.h"
 #include "MIDIGeneratorEnv.h"
+#include "LatencyHistogram.h"
 
 #define IS_VERSION(MAJOR, MINOR) (ENGINE_MAJOR_VERSION == MAJOR) && (ENGINE_MINOR_VERSION == MINOR)
 #define IS_VERSION_OR_PREV(MAJOR, MINOR) (ENGINE_MAJOR_VERSION == MAJOR) && (ENGINE_MINOR_VERSION <= MINOR)
@@ -233,6 +234,7 @@ namespace Metasound
 		void Execute()
 		{
 			SCOPE_CYCLE_COUNTER(STAT_MidiGen);
+			FScopedLatency ScopedLatency(ELatencyStage::Execute);
 
 			TryUpdateGenThreadInput();
 
@@ -253,6 +255,13 @@ namespace Metasound
 			Generator->DecodeTokens();
 #if IS_VERSION_OR_PREV(5, 4)
 			Outputs.MidiClock->GetDrivingMidiPlayCursorMgr()->MidiDataChangeComplete(FMidiPlayCursorMgr::EMidiChangePositionCorrectMode::MaintainTick);
+#elif IS_VERSION_OR_AFTER(5, 6)
+			if (NbTrackCompactions != Generator->NbTrackCompactions)
+			{
+				// Events behind the playhead were trimmed, the cursor's event indices are outdated
+				NbTrackCompactions = Generator->NbTrackCompactions;
+				MidiCursor.SeekToNextTick(Outputs.MidiClock->GetNextMidiTickToProcess(), 0, this);
+			}
 #endif
 			Generator->ClockLock.Unlock();
 
@@ -388,6 +397,7 @@ namespace Metasound
 #if IS_VERSION_OR_AFTER(5, 6)
 		int32 CurrentRenderBlockFrame = 0;
 		FMidiCursor MidiCursor;
+		int32 NbTrackCompactions = 0;
 #endif
 
 		void InitTransportIfNeeded()